@@ -7,52 +7,50 @@
  */
 
 #include <stdlib.h>
+#include <strings.h>
 #include "compiler.hpp"
 #include "parser.hpp"
 #include "machine.hpp"
 #include "label.hpp"
-#include "upper.hpp"
 
-void compiler::error(const std::string& s)
+template<typename word_t>
+void basic_compiler<word_t>::error(const std::string& s)
 {
   if ( callback )
     callback(s.c_str());
 }
 
-bool compiler::islabel(const std::string& s)
+template<typename word_t>
+bool basic_compiler<word_t>::islabel(std::string_view s)
 {
   size_t l = s.length();
   return l<1? false : s[l-1] == ':';
 }
 
-bool compiler::iscomment(const std::string& s)
+template<typename word_t>
+bool basic_compiler<word_t>::iscomment(std::string_view s)
 {
   return s[0] == ';';
 }
 
-Op compiler::tok2op(const std::string& s)
+template<typename word_t>
+Op basic_compiler<word_t>::tok2op(std::string_view s)
 {
-  return from_s(s.c_str());
+  return from_s(s.data(), s.length());
 }
 
-bool compiler::isliteral(const std::string& s)
+template<typename word_t>
+bool basic_compiler<word_t>::isnumber(std::string_view s)
 {
-  if ( islabel(s) )
-    return false;
-
-  return tok2op(s) == NOP_END;
-}
-
-bool compiler::isnumber(const char* s)
-{
-  while ( *s )
-    if ( !isdigit(*s++) )
+  for ( size_t n=0; n < s.length(); ++n )
+    if ( s[n] < '0' || s[n] > '9' )
       return false;
 
   return true;
 }
 
-bool compiler::ischar(const std::string& s)
+template<typename word_t>
+bool basic_compiler<word_t>::ischar(std::string_view s)
 {
   size_t l = s.length();
 
@@ -66,7 +64,8 @@ bool compiler::ischar(const std::string& s)
   return false;
 }
 
-char compiler::to_ord(const std::string& s)
+template<typename word_t>
+char basic_compiler<word_t>::to_ord(std::string_view s)
 {
   size_t l = s.length();
 
@@ -81,19 +80,30 @@ char compiler::to_ord(const std::string& s)
     case '0': return '\0';
     }
 
-  error("Unknown character literal: " + s);
+  error("Unknown character literal: " + std::string(s));
   return '\0';
 }
 
-bool compiler::islabel_ref(const std::string& s)
+template<typename word_t>
+bool basic_compiler<word_t>::islabel_ref(std::string_view s)
 {
   return s[0] == '&';
 }
 
-int32_t compiler::to_literal(const std::string& s)
+template<typename word_t>
+word_t basic_compiler<word_t>::to_literal(std::string_view s)
 {
-  if ( isnumber(s.c_str()) )
-    return atoi(s.c_str());
+  if ( isnumber(s) ) {
+    // as strtoll(), giving the largest number on overflow
+    int64_t n = 0;
+
+    for ( size_t i=0; i < s.length(); ++i ) {
+      const int d = s[i] - '0';
+      n = n > (INT64_MAX - d)/10 ? INT64_MAX : 10*n + d;
+    }
+
+    return static_cast<word_t>(n);
+  }
 
   if ( ischar(s) )
     return to_ord(s);
@@ -101,30 +111,97 @@ int32_t compiler::to_literal(const std::string& s)
   return -1;
 }
 
-bool compiler::ishalt(const std::string& s)
+template<typename word_t>
+bool basic_compiler<word_t>::ishalt(std::string_view s)
 {
-  return s.empty() || upper(s)=="HALT";
+  return s.empty() || (s.length() == 4 && !strncasecmp(s.data(), "HALT", 4));
 }
 
-void compiler::check_label_name(const std::string& label)
+template<typename word_t>
+bool basic_compiler<word_t>::isnoinline(std::string_view s)
 {
-  if ( upper(label) == "HERE" )
+  return s.length() == 8 && !strncasecmp(s.data(), "NOINLINE", 8);
+}
+
+template<typename word_t>
+void basic_compiler<word_t>::check_label_name(std::string_view label)
+{
+  if ( label.length() == 4 && !strncasecmp(label.data(), "HERE", 4) )
     error("Label is reserved: HERE");
 }
 
-compiler::compiler(void (*cb)(const char*)) :
+// Keeps code for later when optimizing, and returns whether it did
+template<typename word_t>
+bool basic_compiler<word_t>::defer(insn_kind_t kind, Op op, word_t value,
+                                   std::string_view name)
+{
+  if ( !optimizing )
+    return false;
+
+  code.push_back(insn_t<word_t>(kind, op, value, std::string(name)));
+  return true;
+}
+
+template<typename word_t>
+void basic_compiler<word_t>::define_label(std::string_view s)
+{
+  if ( !optimizing ) {
+    m.addlabel(s, m.pos());
+    return;
+  }
+
+  // found here rather than when laid out, for the line number
+  std::string_view name = s.substr(0, s.length()-1);
+
+  if ( !defined.add(name.data(), name.length(), 0) )
+    error("Duplicate label: " + std::string(name));
+  else
+    defer(INSN_LABEL, NOP, 0, name);
+}
+
+template<typename word_t>
+void basic_compiler<word_t>::lay_out()
+{
+  optimize(code, inline_cells);
+
+  for ( size_t n=0; n < code.size(); ++n ) {
+    const insn_t<word_t>& i = code[n];
+
+    switch ( i.kind ) {
+    case INSN_OP:    m.load(i.op); break;
+    case INSN_PUSH:  m.load(PUSH); m.load(i.value); break;
+    case INSN_REF:   compile_label(i.name); break;
+    case INSN_CALL:  compile_function_call(i.name); break;
+    case INSN_LABEL: m.addlabel(i.name + ":", m.pos()); break;
+    case INSN_HALT:  m.load_halt(); break;
+    case INSN_NOINLINE: break;
+    }
+  }
+
+  code.clear();
+}
+
+template<typename word_t>
+basic_compiler<word_t>::basic_compiler(void (*cb)(const char*)) :
   m(cb),
   forwards(),
-  callback(cb)
+  callback(cb),
+  optimizing(false),
+  inline_cells(INLINE_CELLS),
+  code(),
+  defined()
 {
 }
 
-void compiler::set_error_callback(void (*error_callback)(const char* message))
+template<typename word_t>
+void basic_compiler<word_t>::set_error_callback(
+  void (*error_callback)(const char* message))
 {
   callback = error_callback;
 }
 
-void compiler::compile_label(const std::string& label)
+template<typename word_t>
+void basic_compiler<word_t>::compile_label(std::string_view label)
 {
   int32_t address = m.get_label_address(label);
 
@@ -133,20 +210,21 @@ void compiler::compile_label(const std::string& label)
   // if label not found, mark it for update
   if ( address == -1 ) {
     check_label_name(label);
-    forwards.push_back(label_t(label, m.pos()));
+    forwards.push_back(label_t(std::string(label), m.pos()));
   }
 
   m.load(address);
 }
 
-void compiler::compile_function_call(const std::string& function)
+template<typename word_t>
+void basic_compiler<word_t>::compile_function_call(std::string_view function)
 {
   // Return address is here plus four instructions
   m.load(PUSHIP); m.load(m.pos() + 4*m.wordsize());
 
   // Push function destination address -- update it later
   m.load(PUSH);
-  forwards.push_back(label_t(function, m.pos()));
+  forwards.push_back(label_t(std::string(function), m.pos()));
   m.load(-1); // just push an arbitrary number
 
   // Jump to function
@@ -155,30 +233,36 @@ void compiler::compile_function_call(const std::string& function)
   // This is the return point
 }
 
-void compiler::compile_literal(const std::string& token)
+template<typename word_t>
+void basic_compiler<word_t>::compile_literal(std::string_view token)
 {
   if ( islabel_ref(token) ) {
-    compile_label(token.substr(1));
+    if ( !defer(INSN_REF, NOP, 0, token.substr(1)) )
+      compile_label(token.substr(1));
     return;
   }
 
-  int32_t literal = to_literal(token);
+  word_t literal = to_literal(token);
 
   // Literals are pushed on to the stack
   if ( literal != -1 ) {
-    m.load(PUSH);
-    m.load(literal);
+    if ( !defer(INSN_PUSH, NOP, literal) ) {
+      m.load(PUSH);
+      m.load(literal);
+    }
     return;
   }
 
   // Unknown literals are treated as forward function calls
-  compile_function_call(token);
+  if ( !defer(INSN_CALL, NOP, 0, token) )
+    compile_function_call(token);
 }
 
-void compiler::resolve_forwards()
+template<typename word_t>
+void basic_compiler<word_t>::resolve_forwards()
 {
   for ( size_t n=0; n<forwards.size(); ++n ) {
-    std::string label = forwards[n].name;
+    const std::string& label = forwards[n].name;
     int32_t address = m.get_label_address(label);
 
     if ( address == -1 )
@@ -190,38 +274,56 @@ void compiler::resolve_forwards()
 }
 
 // Return FALSE when compilation has finished
-bool compiler::compile_token(const std::string& s, parser& p)
+template<typename word_t>
+bool basic_compiler<word_t>::compile_token(std::string_view s, parser& p)
 {
   if ( s.empty() ) {
-    m.load_halt();
+    if ( !defer(INSN_HALT) )
+      m.load_halt();
+
+    if ( optimizing )
+      lay_out();
+
     resolve_forwards();
     return false;
   }
-  else if ( ishalt(s) )    m.load_halt();
+  else if ( ishalt(s) ) {
+    if ( !defer(INSN_HALT) )
+      m.load_halt();
+  }
   else if ( iscomment(s) ) p.skip_line();
-  else if ( isliteral(s) ) compile_literal(s);
-  else if ( islabel(s) )   m.addlabel(s.c_str(), m.pos());
+  else if ( islabel(s) )   define_label(s);
+  else if ( isnoinline(s) ) defer(INSN_NOINLINE);
   else {
+    // anything that is not an operation is a literal
     Op op = tok2op(s);
 
     if ( op == NOP_END )
-      error("Unknown operation: " + s);
-
-    m.load(op);
+      compile_literal(s);
+    else if ( !defer(INSN_OP, op) )
+      m.load(op);
   }
 
   return true;
 }
 
-machine_t& compiler::get_program()
+template<typename word_t>
+basic_machine_t<word_t>& basic_compiler<word_t>::get_program()
 {
   return m;
 }
 
-compiler::compiler(parser& p, void (*fp)(const char*)) :
-  m(fp), forwards(), callback(fp)
+template<typename word_t>
+basic_compiler<word_t>::basic_compiler(parser& p, void (*fp)(const char*),
+                                       size_t memory_words, bool optimize,
+                                       size_t inline_limit) :
+  m(fp, memory_words), forwards(), callback(fp), optimizing(optimize),
+  inline_cells(inline_limit), code(), defined()
 {
   // Perform complete compilation
   while ( compile_token(p.next_token(), p) )
     ; // loop
 }
+
+template class basic_compiler<int32_t>;
+template class basic_compiler<int64_t>;
@@ -0,0 +1,82 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <type_traits>
+
+#ifndef INC_ARITH_HPP
+#define INC_ARITH_HPP
+
+/*
+ * Arithmetic on words wraps around, also where C++ leaves it undefined,
+ * and shift counts are taken modulo the bits in a word, just like on x86.
+ * The divisor must not be zero.  Operands are in the order they are
+ * pushed, so that b is below a on the stack.
+ */
+template<typename word_t>
+inline word_t op_add(word_t b, word_t a)
+{
+  typedef typename std::make_unsigned<word_t>::type uword_t;
+  return static_cast<word_t>(static_cast<uword_t>(b) +
+                             static_cast<uword_t>(a));
+}
+
+template<typename word_t>
+inline word_t op_sub(word_t b, word_t a)
+{
+  typedef typename std::make_unsigned<word_t>::type uword_t;
+  return static_cast<word_t>(static_cast<uword_t>(b) -
+                             static_cast<uword_t>(a));
+}
+
+template<typename word_t>
+inline word_t op_mul(word_t b, word_t a)
+{
+  typedef typename std::make_unsigned<word_t>::type uword_t;
+  return static_cast<word_t>(static_cast<uword_t>(b) *
+                             static_cast<uword_t>(a));
+}
+
+template<typename word_t>
+inline word_t op_div(word_t b, word_t a)
+{
+  typedef typename std::make_unsigned<word_t>::type uword_t;
+
+  // INT32_MIN / -1 overflows
+  return a == -1 ? static_cast<word_t>(0u - static_cast<uword_t>(b))
+                 : b / a;
+}
+
+template<typename word_t>
+inline word_t op_mod(word_t b, word_t a)
+{
+  return a == -1 ? 0 : b % a;
+}
+
+template<typename word_t>
+inline word_t op_shl(word_t b, word_t a)
+{
+  typedef typename std::make_unsigned<word_t>::type uword_t;
+  return static_cast<word_t>(static_cast<uword_t>(b)
+                             << (a & (8*sizeof(word_t) - 1)));
+}
+
+template<typename word_t>
+inline word_t op_shr(word_t b, word_t a)
+{
+  typedef typename std::make_unsigned<word_t>::type uword_t;
+  return static_cast<word_t>(static_cast<uword_t>(b)
+                             >> (a & (8*sizeof(word_t) - 1)));
+}
+
+template<typename word_t>
+inline word_t op_sar(word_t b, word_t a)
+{
+  return b >> (a & (8*sizeof(word_t) - 1));
+}
+
+#endif
@@ -9,41 +9,64 @@
 #include "instructions.hpp"
 #include "parser.hpp"
 #include "machine.hpp"
+#include "optimizer.hpp"
 
 #ifndef INC_COMPILER_HPP
 #define INC_COMPILER_HPP
 
-class compiler
+/*
+ * Compiles source to a machine with words of word_t, see basic_machine_t.
+ *
+ * When optimizing, code is kept until the end of the source, and laid out
+ * in memory after optimize() has seen all of it.  Calls of functions of
+ * up to inline_cells cells are inlined, except for functions containing
+ * the word "noinline", which compiles to nothing.
+ */
+template<typename word_t>
+class basic_compiler
 {
-  machine_t m;
+  basic_machine_t<word_t> m;
   std::vector<label_t> forwards;
   void (*callback)(const char*);
+  bool optimizing;
+  size_t inline_cells; // largest function inlined when optimizing
+  std::vector<insn_t<word_t> > code; // kept when optimizing
+  label_table_t defined; // labels in code
 
   void error(const std::string& s);
-  char to_ord(const std::string& s);
-  int32_t to_literal(const std::string& s);
-  void check_label_name(const std::string& label);
-
-  static bool islabel(const std::string& s);
-  static bool iscomment(const std::string& s);
-  static Op tok2op(const std::string& s);
-  static bool isliteral(const std::string& s);
-  static bool isnumber(const char* s);
-  static bool ischar(const std::string& s);
-  static bool islabel_ref(const std::string& s);
-  static bool ishalt(const std::string& s);
+  char to_ord(std::string_view s);
+  word_t to_literal(std::string_view s);
+  void check_label_name(std::string_view label);
+  bool defer(insn_kind_t kind, Op op = NOP, word_t value = 0,
+             std::string_view name = std::string_view());
+  void define_label(std::string_view s);
+  void lay_out();
+
+  static bool islabel(std::string_view s);
+  static bool iscomment(std::string_view s);
+  static Op tok2op(std::string_view s);
+  static bool isnumber(std::string_view s);
+  static bool ischar(std::string_view s);
+  static bool islabel_ref(std::string_view s);
+  static bool ishalt(std::string_view s);
+  static bool isnoinline(std::string_view s);
 
 public:
-  compiler(void (*error_callback)(const char* message) = NULL);
-  compiler(parser& p, void (*error_callback)(const char* message) = NULL);
+  basic_compiler(void (*error_callback)(const char* message) = NULL);
+  basic_compiler(parser& p, void (*error_callback)(const char* message) = NULL,
+                 size_t memory_words = MEMORY_WORDS, bool optimize = false,
+                 size_t inline_limit = INLINE_CELLS);
 
   void set_error_callback(void (*error_callback)(const char* message));
-  void compile_label(const std::string& label);
-  void compile_function_call(const std::string& function);
-  void compile_literal(const std::string& token);
+  void compile_label(std::string_view label);
+  void compile_function_call(std::string_view function);
+  void compile_literal(std::string_view token);
   void resolve_forwards();
-  bool compile_token(const std::string& s, parser& p);
-  machine_t& get_program();
+  bool compile_token(std::string_view s, parser& p);
+  basic_machine_t<word_t>& get_program();
 };
 
+typedef basic_compiler<int32_t> compiler;
+typedef basic_compiler<int64_t> compiler64;
+
 #endif
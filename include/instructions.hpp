@@ -6,6 +6,8 @@
  *
  */
 
+#include <stddef.h>
+
 #ifndef INC_SMCORE_H
 #define INC_SMCORE_H
 
@@ -34,12 +36,39 @@ enum Op {
   POPIP,  // pop IP stack to current IP, effectively performing a jump
   DROPIP, // pop IP, but do not jump
   COMPL,  // pop a, push the complement of a
+  READ,   // pop len, pop a, read up to len bytes into the cells from a,
+          // push count
+  WRITE,  // pop len, pop a, write the len cells from a as bytes, push count
+  MUL,  // pop a, pop b, push b * a
+  DIV,  // pop a, pop b, push b / a, rounded towards zero
+  MOD,  // pop a, pop b, push the remainder of b / a
+  SHL,  // pop a, pop b, push b shifted left by a
+  SHR,  // pop a, pop b, push b shifted right by a, filling with zeros
+  SAR,  // pop a, pop b, push b shifted right by a, filling with its sign
+  LT,   // pop a, pop b, push 1 if b < a, else 0
+  GT,   // pop a, pop b, push 1 if b > a, else 0
+  EQ,   // pop a, pop b, push 1 if b == a, else 0
+  VADD, // pop n, pop b, pop a, pop d, set the n cells from d to a[i] + b[i]
+  VSUB, // pop n, pop b, pop a, pop d, set the n cells from d to a[i] - b[i]
+  VAND, // pop n, pop b, pop a, pop d, set the n cells from d to a[i] & b[i]
+  VOR,  // pop n, pop b, pop a, pop d, set the n cells from d to a[i] | b[i]
+  VXOR, // pop n, pop b, pop a, pop d, set the n cells from d to a[i] ^ b[i]
+  VSUM, // pop n, pop a, push the sum of the n cells from a
+  VMIN, // pop n, pop a, push the least of the n cells from a
+  VMAX, // pop n, pop a, push the greatest of the n cells from a
+  VDOT, // pop n, pop b, pop a, push the sum of a[i] * b[i] over n cells
+  MEMCPY, // pop n, pop s, pop d, copy the n cells from s to d
+  MEMSET, // pop n, pop v, pop d, set the n cells from d to v
+  MEMCMP, // pop n, pop b, pop a, push -1, 0 or 1 as a < b, a == b or a > b
+  MEMCHR, // pop n, pop v, pop a, push address of the first v in the n
+          // cells from a, or -1
   NOP_END // placeholder for end of enum; MUST BE LAST
 };
 
-extern const char* OpStr[];
+extern const char* const OpStr[];
 
 const char* to_s(Op op);
 Op from_s(const char* s);
+Op from_s(const char* s, size_t length);
 
 #endif
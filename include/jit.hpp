@@ -0,0 +1,120 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+#ifndef INC_JIT_HPP
+#define INC_JIT_HPP
+
+/*
+ * Machine state passed to native code.  The field offsets are hard-coded
+ * in the generated code, so do not reorder them.
+ */
+struct jit_state_t {
+  int32_t *sp;      // data stack pointer, updated on return
+  int32_t *memory;
+  uint8_t *map;     // nonzero for slots covered by native code
+  void *code;       // the machine's decoded instruction cache
+  uint64_t memsize; // in words
+  int32_t *sbase;   // bottom of data stack
+  int32_t *slimit;  // end of allocated data stack
+  uint64_t retired; // instructions retired, when counting
+  uint64_t limit;   // when counting, loops stop once retired reaches this
+};
+
+/*
+ * Number of cells before and including a written cell whose entries in
+ * the decoded instruction cache must be invalidated, since a decoded
+ * instruction may span this many cells.
+ */
+const int CODE_SPAN = 5;
+
+/*
+ * Runs a block and returns the slot to continue at.  If JIT_INTERPRET is
+ * set, the instruction in that slot must be interpreted.
+ */
+typedef int32_t (*native_fn)(jit_state_t*);
+
+const int32_t JIT_INTERPRET = INT32_MIN;
+
+struct jit_block_t {
+  int32_t start; // first slot
+  int32_t end;   // one past the last slot
+  int need;      // stack depth needed on entry
+  int grow;      // maximum growth of the stack
+  native_fn fn;
+};
+
+/*
+ * Translates hot basic blocks to x86-64 machine code.
+ *
+ * The machine calls hit() every time it jumps to an address.  Once an
+ * address has been jumped to `threshold` times, the straight-line code
+ * following it is compiled.  Like the machine, everything here is
+ * indexed by memory slot rather than byte address.  Blocks stop at
+ * instructions that are not supported natively (I/O, the IP stack,
+ * unknown opcodes), which are left to the interpreter.
+ *
+ * On other platforms, nothing is ever compiled.
+ */
+class jit_t {
+  size_t memsize;
+  int threshold;
+  bool count;           // add retired instructions to jit_state_t
+  jit_block_t **blocks; // block starting at each slot
+  int32_t *counts;      // jumps to each slot
+  uint8_t *map;         // number of blocks covering each slot
+  std::vector<jit_block_t*> all;
+  uint8_t *buffer;
+  size_t used;
+
+  jit_t(const jit_t&); // deny
+  jit_t& operator=(const jit_t&); // deny
+
+  jit_block_t* compile(int32_t start, const int32_t* memory);
+  jit_block_t* promote(int32_t adr, const int32_t* memory);
+  void remove(jit_block_t* b);
+  void flush();
+
+public:
+  jit_t(size_t memory_size, int threshold, bool counting = false);
+  ~jit_t();
+
+  static bool supported();
+
+  bool counting() const
+  {
+    return count;
+  }
+
+  jit_block_t* lookup(int32_t adr) const
+  {
+    return blocks[adr];
+  }
+
+  bool covers(int32_t adr) const
+  {
+    return map[adr] != 0;
+  }
+
+  jit_block_t* hit(int32_t adr, const int32_t* memory)
+  {
+    // counting stops at the threshold, so counts never overflow
+    if ( counts[adr] >= threshold || ++counts[adr] != threshold )
+      return NULL;
+
+    return promote(adr, memory);
+  }
+
+  void invalidate(int32_t adr);
+  uint8_t* codemap() const;
+};
+
+#endif
@@ -7,7 +7,9 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string>
+#include <vector>
 
 #ifndef INC_LABEL_HPP
 #define INC_LABEL_HPP
@@ -22,4 +24,35 @@ struct label_t {
   }
 };
 
+/*
+ * Labels by name, ignoring case.
+ *
+ * Names are stored in upper case once, as they are added, in the order
+ * they were added.  An open-addressing hash table of indices finds them
+ * again, hashing and comparing the name being looked up in upper case as
+ * it goes, so that lookups do not allocate.
+ */
+class label_table_t {
+  std::vector<label_t> labels;
+  std::vector<int32_t> slots; // index into labels, or -1; a power of two
+
+  static uint32_t hash(const char* name, size_t length);
+  static bool same(const std::string& upper, const char* name, size_t length);
+  size_t find_slot(const char* name, size_t length) const;
+  void grow();
+
+public:
+  label_table_t();
+
+  // adds a label, unless there is one by that name already; returns
+  // whether it was added
+  bool add(const char* name, size_t length, int32_t pos);
+
+  // the position of a label, or -1 if there is none
+  int32_t find(const char* name, size_t length) const;
+
+  // all labels, in the order they were added
+  const std::vector<label_t>& all() const;
+};
+
 #endif
@@ -9,66 +9,212 @@
 #include <stdio.h>
 #include <vector>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include "instructions.hpp"
 #include "label.hpp"
+#include "jit.hpp"
+#include "snapshot.hpp"
+#include "profile.hpp"
+#include "stats.hpp"
 
 #ifndef INC_MACHINE_HPP
 #define INC_MACHINE_HPP
 
-class machine_t {
-  std::vector<int32_t> stack;
-  std::vector<int32_t> stackip;
-  std::vector<label_t> labels;
-  size_t memsize;
-  int32_t *memory;
+// Default and largest number of memory cells.  Addresses must fit in a
+// positive int32_t, so machines with 64-bit words can have half as many,
+// see basic_machine_t::MAX_WORDS.
+const size_t MEMORY_WORDS = 1000*1024;
+const size_t MAX_MEMORY_WORDS = 0x20000000;
+
+/*
+ * Images of machines with 64-bit words start with this header.  Those of
+ * 32-bit words have none, so that old images still load; no runnable one
+ * starts with these bytes.
+ */
+const char IMAGE64_MAGIC[8] = "SM64IMG";
+
+// The word size in bits of the image in a file, from its header
+int image_word_bits(const char* filename);
+
+/*
+ * When output is written to the output stream.  Whatever the policy,
+ * pending output is also written before IN, at halt, on errors and when
+ * run() returns.
+ */
+enum output_policy_t {
+  OUTPUT_AUTO,       // by line to terminals, else OUTPUT_FULL (default)
+  OUTPUT_UNBUFFERED, // after every OUT and OUTNUM
+  OUTPUT_LINE,       // at every newline
+  OUTPUT_FULL        // when the buffer is full
+};
+
+/*
+ * Why run_for() returned.  In every case the machine can be resumed with
+ * another call.
+ */
+enum run_status_t {
+  STATUS_HALTED,    // the program halted
+  STATUS_EXHAUSTED, // the instruction budget ran out
+  STATUS_WAITING,   // input would block; wait for it and resume
+  STATUS_ERROR      // an error was reported, at the instruction at pos()
+};
+
+/*
+ * The machine, over the type of its memory cells and stack entries.
+ * There are instantiations for int32_t (machine_t) and int64_t
+ * (machine64_t).  Addresses are words like any other, but always fit in
+ * an int32_t.  Only machines with 32-bit words are compiled to native
+ * code.
+ */
+template<typename word_t>
+class basic_machine_t {
+  friend class basic_snapshot_t<word_t>;
+
+  typedef typename std::make_unsigned<word_t>::type uword_t;
+
+  // a decoded memory cell, see run()
+  struct decoded_t {
+    int32_t op;  // handler number
+    word_t imm;  // immediate operand for PUSH and PUSHIP
+  };
+
+  // pending output, allocated on first use
+  struct outbuf_t {
+    size_t len;
+    size_t limit; // write out once this much is pending
+    bool lines;   // write out at newlines
+    char data[4096];
+  };
+
+  word_t *stack;    // data stack, see run() for the layout
+  size_t stack_capacity;
+  size_t stack_size; // entries allocated, growing up to the capacity
+  size_t stack_depth;
+  word_t *stackip;  // instruction pointer stack
+  size_t stackip_capacity;
+  size_t stackip_size;
+  size_t stackip_depth;
+  label_table_t labels;
+  size_t memsize;    // in words
+  word_t *memory;    // one word per slot, see slot()
+  decoded_t *code; // decoded instruction cache, built lazily by run()
+  jit_t *jit;      // native code for hot blocks, built lazily by run()
+  int jit_threshold;
+  bool counting;    // count retired instructions, see run()
+  uint64_t retired;
+  profile_t *profile; // counts for profiling mode, see run()
+  stats_t *stats;     // resource usage, when collecting it
   int32_t ip; // instruction pointer
   FILE* fin;
   FILE* fout;
+  output_policy_t output_policy;
+  outbuf_t *outbuf;
   bool running;
   void (*error_cb)(const char*);
 
+  static uword_t slot(word_t adr);
+  static word_t* map_snapshot(const basic_snapshot_t<word_t>& s, word_t* at);
+  decoded_t decode(uint32_t slot) const;
+  void invalidate(uint32_t slot);
+  void invalidate(uint32_t slot, size_t count);
+  void drop_code();
+  outbuf_t* output();
+  void configure_output();
+  void flush_output() const;
+  void put(word_t c);
+  void put_number(uword_t n);
+  bool check_range(word_t adr, word_t len, uword_t& first) const;
+  size_t read_cells(uint32_t first, size_t count);
+  size_t write_cells(uint32_t first, size_t count);
+  bool vector(Op op, word_t dst, word_t a, word_t b, word_t len);
+  bool reduce(Op op, word_t a, word_t len, word_t& result) const;
+  bool dot(word_t a, word_t b, word_t len, word_t& result) const;
+  bool copy_cells(word_t dst, word_t src, word_t len);
+  bool fill_cells(word_t dst, word_t value, word_t len);
+  bool compare_cells(word_t a, word_t b, word_t len, word_t& result) const;
+  bool find_cell(word_t a, word_t value, word_t len, word_t& result) const;
+  void instr_vector(Op op);
+  void instr_reduce(Op op);
+
+  // what run() keeps track of, selecting an instantiation of execute()
+  enum {
+    RUN_COUNT = 1,  // instructions retired
+    RUN_PROFILE = 2, // instructions per address, opcode and call stack
+    RUN_STATS = 4,   // resource usage
+    RUN_BUDGET = 8   // stop after a number of instructions
+  };
+
+  template<int MODE>
+  run_status_t execute(int32_t start_address, uint64_t budget);
+  run_status_t resume(int32_t start_address, uint64_t budget);
+
 public:
-  machine_t(void (*error_callback)(const char* msg));
-  machine_t(
-    const size_t memory_size = 1024*1000/sizeof(int32_t),
+  // largest number of memory cells, see MAX_MEMORY_WORDS
+  static const size_t MAX_WORDS =
+    MAX_MEMORY_WORDS*sizeof(int32_t)/sizeof(word_t);
+
+  basic_machine_t(
+    void (*error_callback)(const char* msg),
+    const size_t memory_words = MEMORY_WORDS);
+  basic_machine_t(
+    const size_t memory_words = MEMORY_WORDS,
     FILE* out = stdout,
     FILE* in  = stdin,
     void (*error_callback)(const char* msg) = NULL);
-  machine_t(const machine_t& p, void (*error_callback)(const char* msg) = NULL);
-  machine_t& operator=(const machine_t& p);
-  ~machine_t();
+  basic_machine_t(const basic_machine_t& p,
+    void (*error_callback)(const char* msg) = NULL);
+  basic_machine_t(const basic_snapshot_t<word_t>& s,
+    void (*error_callback)(const char* msg) = NULL);
+  basic_machine_t& operator=(const basic_machine_t& p);
+  ~basic_machine_t();
   void reset();
+  void rollback(const basic_snapshot_t<word_t>& s);
+  void set_stack_capacity(size_t data, size_t ip_stack);
   void error(const char* s) const;
-  void push(const int32_t& n);
-  int32_t pop();
-  void puship(const int32_t&);
-  int32_t popip();
-  void check_bounds(int32_t n, const char* msg) const; 
+  void push(const word_t& n);
+  word_t pop();
+  void puship(const word_t&);
+  word_t popip();
+  void check_bounds(word_t n, const char* msg) const;
   void next();
   void prev();
   void load(Op);
-  void load(int32_t n);
+  void load(word_t n);
   int run(int32_t start_address = 0);
+  void start(int32_t start_address = 0);
+  run_status_t run_for(uint64_t max_steps);
   void exec(Op);
-  int32_t* find_end() const;
+  word_t* find_end() const;
   void load_image(FILE* f);
   void save_image(FILE* f) const;
   void load_halt();
   void showstack() const;
 
   size_t size() const;
-  int32_t cur() const;
+  word_t cur() const;
   int32_t pos() const;
 
-  int32_t get_label_address(const std::string& label) const;
-  void addlabel(const char* name, int32_t pos, int lineno = -1);
+  int32_t get_label_address(std::string_view label) const;
+  void addlabel(std::string_view name, int32_t pos, int lineno = -1);
 
   bool isrunning() const;
   void set_fout(FILE*);
   void set_fin(FILE*);
+  FILE* get_fin() const;
+  void set_error_callback(void (*error_callback)(const char* msg));
+  void set_output_policy(output_policy_t policy);
+  void flush();
+  void set_jit_threshold(int jumps);
+  void count_instructions(bool enable);
+  uint64_t instructions() const;
+  void set_profiling(bool enable);
+  const profile_t* get_profile() const;
+  void collect_stats(bool enable);
+  const stats_t* get_stats() const;
 
-  void set_mem(int32_t adr, int32_t val);
-  int32_t get_mem(int32_t adr) const;
+  void set_mem(int32_t adr, word_t val);
+  word_t get_mem(int32_t adr) const;
   int32_t wordsize() const;
 
   // instructions
@@ -96,6 +242,33 @@ public:
   void instr_swap();   
   void instr_rol3();   
   void instr_compl();
+  void instr_mul();
+  void instr_div();
+  void instr_mod();
+  void instr_shl();
+  void instr_shr();
+  void instr_sar();
+  void instr_lt();
+  void instr_gt();
+  void instr_eq();
+  void instr_vadd();
+  void instr_vsub();
+  void instr_vand();
+  void instr_vor();
+  void instr_vxor();
+  void instr_vsum();
+  void instr_vmin();
+  void instr_vmax();
+  void instr_vdot();
+  void instr_memcpy();
+  void instr_memset();
+  void instr_memcmp();
+  void instr_memchr();
+  void instr_read();
+  void instr_write();
 };
 
+typedef basic_machine_t<int32_t> machine_t;
+typedef basic_machine_t<int64_t> machine64_t;
+
 #endif
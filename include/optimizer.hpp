@@ -0,0 +1,67 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "instructions.hpp"
+
+#ifndef INC_OPTIMIZER_HPP
+#define INC_OPTIMIZER_HPP
+
+enum insn_kind_t {
+  INSN_OP,    // an instruction without an operand
+  INSN_PUSH,  // PUSH of a number
+  INSN_REF,   // PUSH of the address of a label, from "&label"
+  INSN_CALL,  // call of a label, from "label"
+  INSN_LABEL, // definition of a label, from "label:"
+  INSN_HALT,
+  INSN_NOINLINE // the function it is in must not be inlined
+};
+
+// Largest function body inlined by default, in cells; no larger than a call
+static const size_t INLINE_CELLS = 5;
+
+// Compiled code before it is laid out in memory
+template<typename word_t>
+struct insn_t {
+  insn_kind_t kind;
+  Op op;            // of INSN_OP
+  word_t value;     // of INSN_PUSH
+  std::string name; // of the label, without "&" or ":"
+
+  insn_t(insn_kind_t kind_, Op op_ = NOP, word_t value_ = 0,
+         const std::string& name_ = std::string())
+    : kind(kind_), op(op_), value(value_), name(name_)
+  {
+  }
+};
+
+/*
+ * Rewrites code to run in fewer instructions, with the same effect.
+ *
+ * Calls of short functions are replaced by their code.  A function can be
+ * inlined if its code is at most `inline_cells` cells of instructions and
+ * numbers, without jumps, labels or "noinline", ending in POPIP.
+ *
+ * Runs of pushes and instructions are folded where the numbers are known,
+ * pairs that do nothing are dropped, and multiplying by a power of two
+ * becomes a shift.  Jumps and calls to a label whose code only jumps on
+ * to another label go there directly.
+ *
+ * Code after a label whose address is used as data is left as written,
+ * up to the next label, since it may be read or patched.  So is code
+ * after "&here" or an explicit PUSH or PUSHIP.  Code moves as it
+ * shrinks, so addresses must be taken from labels; numbers used as
+ * addresses may point elsewhere afterwards.
+ */
+template<typename word_t>
+void optimize(std::vector<insn_t<word_t> >& code,
+              size_t inline_cells = INLINE_CELLS);
+
+#endif
@@ -0,0 +1,25 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stddef.h>
+
+#ifndef INC_PAGES_HPP
+#define INC_PAGES_HPP
+
+/*
+ * Allocates zeroed memory directly from the operating system where
+ * possible.  Pages cost nothing until they are touched, and are handed
+ * back on release.  calloc() instead tends to recycle big blocks and
+ * clear them with memset, which costs more than most short programs.
+ *
+ * Throws std::bad_alloc on failure.
+ */
+void* page_alloc(size_t bytes);
+void page_free(void* p, size_t bytes);
+
+#endif
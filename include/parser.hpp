@@ -6,15 +6,34 @@
  *
  */
 
+#include <stdio.h>
 #include <string>
+#include <string_view>
 
 #ifndef INC_PARSER_HPP
 #define INC_PARSER_HPP
 
+/*
+ * Splits source into tokens separated by whitespace.
+ *
+ * Source in memory is split in place, and tokens point into it.  A file
+ * that is a regular file is mapped into memory and split the same way;
+ * anything else, like a pipe on stdin, is read a character at a time.
+ */
 class parser
 {
-  FILE* f;
-  int lineno;
+  FILE* f;            // or NULL, when the source is in memory
+  const char* pos;    // next character in memory
+  const char* end;
+  void* map;          // the mapped file, or NULL
+  size_t map_length;
+  int lineno;         // of the next character
+  int token_lineno;   // of the last token
+  std::string token;  // the last token read from f
+
+  parser(const parser&); // deny
+  parser& operator=(const parser&); // deny
+
   int update_lineno(int c);
   int fgetchar();
   void move_back(int c);
@@ -22,8 +41,17 @@ class parser
 
 public:
   parser(FILE* f);
+
+  // source must outlive the parser
+  parser(const char* source, size_t length);
+  ~parser();
+
+  // the line of the last token
   int get_lineno() const;
-  std::string next_token();
+
+  // the next token, or an empty one at the end of the source; it is
+  // valid until the next call
+  std::string_view next_token();
   void skip_line();
 };
 
@@ -0,0 +1,36 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stddef.h>
+
+#ifndef INC_POOL_HPP
+#define INC_POOL_HPP
+
+/*
+ * Runs numbered jobs on a fixed number of threads.
+ *
+ * Each thread starts out with an equal share of the jobs, which it runs
+ * from the front.  A thread that runs out steals half of what is left from
+ * the back of another thread's share, so uneven jobs still keep all
+ * threads busy.
+ */
+class pool_t {
+  size_t nthreads;
+
+public:
+  // zero means one thread per core
+  pool_t(size_t threads = 0);
+
+  size_t threads() const;
+
+  // calls fn(job, arg) for each job from 0 to jobs-1, and returns when
+  // all of them are done
+  void run(size_t jobs, void (*fn)(size_t job, void* arg), void* arg);
+};
+
+#endif
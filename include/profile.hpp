@@ -0,0 +1,118 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include "instructions.hpp"
+#include "label.hpp"
+
+#ifndef INC_PROFILE_HPP
+#define INC_PROFILE_HPP
+
+/*
+ * Instruction counts gathered by machine_t::run() in profiling mode.
+ *
+ * Every executed instruction is counted at its slot and under its opcode.
+ * It is also counted under its call stack, which is the IP stack of return
+ * addresses plus the label the instruction belongs to.  An instruction
+ * belongs to the nearest label at or before it.  Without labels, as for
+ * images run by smr, addresses stand in for them.
+ *
+ * Call stacks are kept as a tree of frames, one for each distinct
+ * sequence of return addresses, so that following calls and returns costs
+ * a lookup only when the stack changes.
+ */
+class profile_t {
+  struct frame_t {
+    int32_t parent;
+    int32_t ret; // return address pushed to enter this frame
+  };
+
+  size_t memsize;
+  size_t wordsize;          // in bytes, mapping addresses to slots
+  uint64_t *hits;           // instructions executed at each slot
+  uint64_t ops[NOP_END + 1]; // by opcode, with unknown ones last
+  int32_t *owner;           // label of each slot, or -1 before the first
+  std::vector<std::string> names; // labels, by index in owner
+  std::unordered_map<std::string, int32_t> index; // of each name
+  std::vector<int32_t> positions; // address of each label
+  std::vector<frame_t> frames;    // frames[0] is the empty stack
+  std::unordered_map<uint64_t, int32_t> children;
+  std::unordered_map<uint64_t, uint64_t> stacks; // by frame and leaf
+  int32_t frame;     // current frame
+  int32_t leaf;      // label of the last instruction counted
+  uint64_t *current; // its count in stacks, or NULL after a call or return
+
+  profile_t(const profile_t&); // deny
+  profile_t& operator=(const profile_t&); // deny
+
+  static uint64_t key(int32_t a, int32_t b)
+  {
+    return static_cast<uint64_t>(static_cast<uint32_t>(a)) << 32
+         | static_cast<uint32_t>(b);
+  }
+
+  // the label index of a slot, or -2-slot if there are no labels
+  int32_t label_at(uint32_t slot) const
+  {
+    return owner ? owner[slot] : -2 - static_cast<int32_t>(slot);
+  }
+
+  std::string name(int32_t label) const;
+  std::string where(int32_t adr) const;
+
+public:
+  profile_t();
+  ~profile_t();
+
+  // prepares for a run with the given memory, labels and IP stack, for
+  // a machine with words of word_t
+  template<typename word_t>
+  void start(size_t memory_words, const std::vector<label_t>& labels,
+             const word_t* stackip, size_t depth);
+
+  uint64_t total() const;
+
+  void hit(uint32_t slot, int64_t op)
+  {
+    ++hits[slot];
+    ++ops[std::min<uint64_t>(op, NOP_END)];
+
+    int32_t l = label_at(slot);
+
+    if ( current == NULL || l != leaf ) {
+      leaf = l;
+      current = &stacks[key(frame, l)];
+    }
+
+    ++*current;
+  }
+
+  // takes back the last hit(), when an instruction is dispatched twice
+  void unhit(uint32_t slot, int64_t op)
+  {
+    --hits[slot];
+    --ops[std::min<uint64_t>(op, NOP_END)];
+    --*current;
+  }
+
+  void call(int32_t ret);
+  void ret();
+
+  // a summary by opcode, label and address
+  void report(FILE* f) const;
+
+  // one line per call stack, as read by flamegraph.pl and similar tools
+  void folded(FILE* f) const;
+};
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+#include "machine.hpp"
+
+#ifndef INC_SCHEDULER_HPP
+#define INC_SCHEDULER_HPP
+
+/*
+ * Runs many machines as green threads on the calling thread.
+ *
+ * Each machine runs for a slice of instructions at a time with
+ * machine_t::run_for(), in turn with the others.  Input is made
+ * non-blocking, so that a machine that would block on IN or READ is
+ * parked instead.  Parked machines cost no time; the scheduler sleeps in
+ * epoll (or poll, where there is no epoll) until input arrives for one of
+ * them, or until another is ready to run.
+ *
+ * Each machine must read from its own file descriptor.  Machines are not
+ * owned by the scheduler, and must outlive it or be done.  Their stacks
+ * start small and grow.
+ */
+template<typename word_t>
+class basic_scheduler_t {
+  struct task_t {
+    basic_machine_t<word_t> *m;
+    int fd;     // of its input
+    bool armed; // registered for input at least once
+  };
+
+  uint64_t slice;
+  std::vector<task_t> tasks;
+  std::deque<size_t> ready;
+  size_t live;   // tasks not done yet
+  size_t parked; // tasks waiting for input
+  int epfd;      // or -1 for poll
+  std::vector<size_t> waiting; // parked tasks, with poll
+
+  basic_scheduler_t(const basic_scheduler_t&); // deny
+  basic_scheduler_t& operator=(const basic_scheduler_t&); // deny
+
+  void park(size_t id);
+  void wake(bool block);
+
+public:
+  // called for each machine as it halts or fails
+  typedef void (*done_fn)(size_t id, basic_machine_t<word_t>* m,
+                          run_status_t status, void* arg);
+
+  basic_scheduler_t(uint64_t instructions_per_slice = 10000);
+  ~basic_scheduler_t();
+
+  // adds a machine to run from pos(), see machine_t::start(); returns
+  // its id, numbered from zero
+  size_t add(basic_machine_t<word_t>* m);
+
+  // runs until all machines are done
+  void run(done_fn done, void* arg);
+};
+
+typedef basic_scheduler_t<int32_t> scheduler_t;
+typedef basic_scheduler_t<int64_t> scheduler64_t;
+
+#endif
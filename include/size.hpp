@@ -0,0 +1,20 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stddef.h>
+
+#ifndef INC_SIZE_HPP
+#define INC_SIZE_HPP
+
+/*
+ * Parses a count like "4096", "64K" or "2M", where the suffixes multiply
+ * by 1024 and 1024*1024.  Returns zero if the string is not a count.
+ */
+size_t parse_size(const char* s);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include "label.hpp"
+
+#ifndef INC_SNAPSHOT_HPP
+#define INC_SNAPSHOT_HPP
+
+template<typename word_t> class basic_machine_t;
+
+/*
+ * The frozen state of a machine, which any number of machines can be
+ * cloned from or rolled back to.
+ *
+ * On Linux, the memory is kept in an anonymous file that the snapshotted
+ * machine and its clones all map privately, so they share pages until
+ * they write to them.  Cloning and rolling back then cost in proportion
+ * to the pages written, not to the size of memory.  Elsewhere, memory is
+ * simply copied.
+ *
+ * Taking a snapshot copies each page that is not all NOP once.  Machines
+ * do not depend on a snapshot after being cloned from it.
+ */
+template<typename word_t>
+class basic_snapshot_t {
+  friend class basic_machine_t<word_t>;
+
+  int fd;          // file holding memory, or -1
+  word_t *copy;    // copy of memory where there is no such file
+  size_t memsize;  // in words
+  std::vector<word_t> stack;   // stack[0] and the data stack
+  size_t stack_capacity;
+  std::vector<word_t> stackip;
+  size_t stackip_capacity;
+  label_table_t labels;
+  int32_t ip;
+  bool running;
+  int jit_threshold;
+  FILE* fin;
+  FILE* fout;
+  int output_policy;
+
+  basic_snapshot_t(const basic_snapshot_t&); // deny
+  basic_snapshot_t& operator=(const basic_snapshot_t&); // deny
+
+public:
+  basic_snapshot_t(basic_machine_t<word_t>& m);
+  ~basic_snapshot_t();
+};
+
+typedef basic_snapshot_t<int32_t> snapshot_t;
+typedef basic_snapshot_t<int64_t> snapshot64_t;
+
+#endif
@@ -0,0 +1,76 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "instructions.hpp"
+
+#ifndef INC_STATS_HPP
+#define INC_STATS_HPP
+
+/*
+ * Resource usage gathered by machine_t::run() when collecting statistics.
+ * Everything adds up over runs.
+ *
+ * Cells count as read or written when instructions use them as data
+ * (LOAD, STOR, READ, WRITE, the vector instructions and the bulk memory
+ * instructions), not when they are executed.
+ */
+class stats_t {
+  size_t memsize;
+  uint8_t *read;    // a bit for each cell read
+  uint8_t *written; // a bit for each cell written
+
+  stats_t(const stats_t&); // deny
+  stats_t& operator=(const stats_t&); // deny
+
+  static size_t count(const uint8_t* bits, size_t cells);
+  static void mark(uint8_t* bits, uint32_t first, size_t count);
+
+public:
+  uint64_t ops[NOP_END + 1]; // instructions by opcode, unknown ones last
+  size_t max_stack;   // deepest data stack
+  size_t max_stackip; // deepest IP stack
+  double seconds;     // wall time spent in run()
+
+  stats_t();
+  ~stats_t();
+
+  // prepares for a run with the given memory size
+  void start(size_t memory_words);
+
+  void load(uint32_t slot)
+  {
+    read[slot >> 3] |= 1 << (slot & 7);
+  }
+
+  void store(uint32_t slot)
+  {
+    written[slot >> 3] |= 1 << (slot & 7);
+  }
+
+  void load(uint32_t first, size_t count)
+  {
+    mark(read, first, count);
+  }
+
+  void store(uint32_t first, size_t count)
+  {
+    mark(written, first, count);
+  }
+
+  uint64_t instructions() const;
+  size_t cells_read() const;
+  size_t cells_written() const;
+
+  // writes everything as a single line of JSON
+  void json(FILE* f) const;
+};
+
+#endif
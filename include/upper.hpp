@@ -1,11 +0,0 @@
-/*
- * Made in 2010 by Christian Stigen Larsen
- * http://csl.sublevel3.org
- *
- * Placed in the public domain by the author.
- *
- */
-
-#include <string>
-
-std::string upper(const std::string& s);
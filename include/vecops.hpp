@@ -0,0 +1,57 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifndef INC_VECOPS_HPP
+#define INC_VECOPS_HPP
+
+// Element-wise operations, in the order of VADD to VXOR
+enum vec_op_t { VEC_ADD, VEC_SUB, VEC_AND, VEC_OR, VEC_XOR, VEC_OPS };
+
+// Reductions, in the order of VSUM to VMAX
+enum vec_reduction_t { VEC_SUM, VEC_MIN, VEC_MAX, VEC_REDUCTIONS };
+
+/*
+ * Kernels for the vector instructions, which work on ranges of memory
+ * cells.  Arithmetic wraps around like ADD and MUL do, and VMIN and VMAX
+ * compare signed, giving the largest and smallest word for no cells.
+ *
+ * For 32-bit words, there is a set of kernels for AVX2 and for SSE2 on
+ * x86-64, and plain loops for everything else, or if NO_SIMD is defined.
+ * 64-bit words always get the plain loops.
+ */
+template<typename word_t>
+struct basic_vecops_t {
+  // dst[i] = a[i] op b[i]; dst may be a or b, but must not overlap them
+  // otherwise
+  typedef void (*binary_fn)(word_t* dst, const word_t* a, const word_t* b,
+                            size_t n);
+
+  typedef word_t (*reduce_fn)(const word_t* a, size_t n);
+  typedef word_t (*dot_fn)(const word_t* a, const word_t* b, size_t n);
+
+  const char *name;
+  binary_fn binary[VEC_OPS];
+  reduce_fn reduce[VEC_REDUCTIONS];
+  dot_fn dot;
+};
+
+typedef basic_vecops_t<int32_t> vecops_t;
+
+/*
+ * The best kernels the CPU supports for a word type, picked on first use.
+ * Setting the environment variable SM_VECOPS to "scalar" or "sse2" picks
+ * slower ones, to compare their results.
+ */
+template<typename word_t> const basic_vecops_t<word_t>& vecops();
+template<> const basic_vecops_t<int32_t>& vecops<int32_t>();
+template<> const basic_vecops_t<int64_t>& vecops<int64_t>();
+
+#endif
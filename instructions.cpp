@@ -7,11 +7,11 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include "instructions.hpp"
 #include "machine.hpp"
-#include "upper.hpp"
 
-const char* OpStr[] = {
+constexpr const char* const OpStr[] = {
   "NOP",
   "ADD",
   "SUB",
@@ -36,6 +36,30 @@ const char* OpStr[] = {
   "POPIP",
   "DROPIP",
   "COMPL",
+  "READ",
+  "WRITE",
+  "MUL",
+  "DIV",
+  "MOD",
+  "SHL",
+  "SHR",
+  "SAR",
+  "LT",
+  "GT",
+  "EQ",
+  "VADD",
+  "VSUB",
+  "VAND",
+  "VOR",
+  "VXOR",
+  "VSUM",
+  "VMIN",
+  "VMAX",
+  "VDOT",
+  "MEMCPY",
+  "MEMSET",
+  "MEMCMP",
+  "MEMCHR",
   "NOP_END"
 };
 
@@ -47,14 +71,87 @@ const char* to_s(Op op)
   return "<?>";
 }
 
-Op from_s(const char* str)
+/*
+ * Opcodes are found by name through a perfect hash, which maps each name
+ * to its own slot in a table of opcodes.  The table is built by the
+ * compiler, trying seeds for the hash until the names do not collide.
+ * Names are hashed and compared in upper case, one character at a time,
+ * so that looking one up takes no allocation.
+ */
+
+static const int OP_HASH_BITS = 8;
+static const uint8_t NO_OP = 0xff;
+
+static constexpr char upcase(char c)
 {
-  std::string s(upper(str));
+  return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+static constexpr uint32_t op_hash(uint32_t seed, const char* s, size_t length)
+{
+  uint32_t h = seed;
+
+  for ( size_t n=0; n < length; ++n )
+    h = (h ^ static_cast<unsigned char>(upcase(s[n]))) * 16777619u;
 
-  // slow, O(n/2) seek... :-)
-  for ( int n=0; n<NOP_END; ++n )
-    if ( s == OpStr[n] )
-      return static_cast<Op>(n);
+  return h >> (32 - OP_HASH_BITS);
+}
+
+static constexpr size_t length_of(const char* s)
+{
+  size_t n = 0;
+
+  while ( s[n] )
+    ++n;
+
+  return n;
+}
+
+struct op_table_t {
+  uint32_t seed;
+  uint8_t op[1 << OP_HASH_BITS]; // by hash, or NO_OP
+};
 
-  return NOP_END;
+static constexpr op_table_t make_op_table()
+{
+  for ( uint32_t seed = 2166136261u; ; ++seed ) {
+    op_table_t t = {seed, {}};
+    bool collides = false;
+
+    for ( int n=0; n < (1 << OP_HASH_BITS); ++n )
+      t.op[n] = NO_OP;
+
+    for ( int n=0; n < NOP_END && !collides; ++n ) {
+      const uint32_t h = op_hash(seed, OpStr[n], length_of(OpStr[n]));
+      collides = t.op[h] != NO_OP;
+      t.op[h] = n;
+    }
+
+    if ( !collides )
+      return t;
+  }
+}
+
+static constexpr op_table_t OP_TABLE = make_op_table();
+static_assert(NOP_END < NO_OP, "Too many opcodes for the hash table");
+
+Op from_s(const char* str, size_t length)
+{
+  const uint8_t op = OP_TABLE.op[op_hash(OP_TABLE.seed, str, length)];
+
+  if ( op == NO_OP )
+    return NOP_END;
+
+  const char *name = OpStr[op];
+
+  for ( size_t n=0; n < length; ++n )
+    if ( name[n] == '\0' || upcase(str[n]) != name[n] )
+      return NOP_END;
+
+  return name[length] == '\0' ? static_cast<Op>(op) : NOP_END;
+}
+
+Op from_s(const char* str)
+{
+  return from_s(str, length_of(str));
 }
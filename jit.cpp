@@ -0,0 +1,651 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "instructions.hpp"
+#include "jit.hpp"
+#include "pages.hpp"
+
+#if defined(__x86_64__) && defined(__linux__) && !defined(NO_JIT)
+# define HAVE_JIT
+# include <sys/mman.h>
+#endif
+
+static const size_t BUFFER_SIZE = 4*1024*1024;
+static const size_t MAX_BLOCK_CODE = 64*1024;
+static const int MAX_BLOCK_INSTRUCTIONS = 256;
+
+// Shorter blocks run faster in the interpreter than through a native call
+static const int MIN_BLOCK_INSTRUCTIONS = 4;
+
+/*
+ * Counter value for addresses that are known not to compile, and the
+ * penalty for blocks that were invalidated by a write into them.
+ */
+static const int32_t NEVER = INT_MIN/2;
+static const int BACKOFF = 4;
+
+jit_t::jit_t(size_t memory_size, int hot_threshold, bool counting) :
+  memsize(memory_size),
+  threshold(hot_threshold),
+  count(counting),
+  blocks(static_cast<jit_block_t**>(
+    page_alloc(memory_size*sizeof(jit_block_t*)))),
+  counts(static_cast<int32_t*>(page_alloc(memory_size*sizeof(int32_t)))),
+  map(static_cast<uint8_t*>(page_alloc(memory_size*sizeof(uint8_t)))),
+  all(),
+  buffer(NULL),
+  used(0)
+{
+#ifdef HAVE_JIT
+  void *p = mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if ( p != MAP_FAILED )
+    buffer = static_cast<uint8_t*>(p);
+#endif
+}
+
+jit_t::~jit_t()
+{
+  flush();
+  page_free(blocks, memsize*sizeof(jit_block_t*));
+  page_free(counts, memsize*sizeof(int32_t));
+  page_free(map, memsize*sizeof(uint8_t));
+
+#ifdef HAVE_JIT
+  if ( buffer )
+    munmap(buffer, BUFFER_SIZE);
+#endif
+}
+
+bool jit_t::supported()
+{
+#ifdef HAVE_JIT
+  return true;
+#else
+  return false;
+#endif
+}
+
+uint8_t* jit_t::codemap() const
+{
+  return map;
+}
+
+jit_block_t* jit_t::promote(int32_t adr, const int32_t* memory)
+{
+  jit_block_t *b = compile(adr, memory);
+
+  if ( b == NULL )
+    counts[adr] = NEVER;
+
+  return b;
+}
+
+void jit_t::remove(jit_block_t* b)
+{
+  blocks[b->start] = NULL;
+
+  for ( int32_t n = b->start; n < b->end; ++n )
+    if ( map[n] != UINT8_MAX )
+      --map[n];
+
+  delete b;
+}
+
+void jit_t::invalidate(int32_t adr)
+{
+  for ( size_t n = 0; n < all.size(); ) {
+    jit_block_t *b = all[n];
+
+    if ( adr >= b->start && adr < b->end ) {
+      counts[b->start] = -BACKOFF*threshold;
+      remove(b);
+      all[n] = all.back();
+      all.pop_back();
+    } else
+      ++n;
+  }
+}
+
+// Drops all blocks, and starts counting jumps over, so that hot code
+// compiles again
+void jit_t::flush()
+{
+  for ( size_t n = 0; n < all.size(); ++n )
+    remove(all[n]);
+
+  all.clear();
+  used = 0;
+
+  // fresh pages read as zero, without touching the old ones
+  page_free(counts, memsize*sizeof(int32_t));
+  counts = static_cast<int32_t*>(page_alloc(memsize*sizeof(int32_t)));
+}
+
+#ifndef HAVE_JIT
+
+jit_block_t* jit_t::compile(int32_t, const int32_t*)
+{
+  return NULL;
+}
+
+#else
+
+/*
+ * Code generation.
+ *
+ * Native code keeps the data stack in memory, exactly like the
+ * interpreter, so that it can hand control back at any instruction.
+ * Register usage is
+ *
+ *   rdi  jit_state_t*
+ *   rsi  data stack pointer
+ *   rdx  memory
+ *   rcx  map of compiled slots
+ *   r8   decoded instruction cache
+ *   r9d  memory size in words
+ *   eax, r10d, r11d  scratch
+ *
+ * Shifts and division need ecx and edx, so they keep rcx and rdx in r10
+ * and r11 while they run.  All of these are caller-saved in the System V
+ * ABI, so blocks need no stack frame.  Whenever an instruction cannot
+ * proceed (out of bounds, halt, write into compiled code, unsupported),
+ * the block returns the slot of that instruction flagged with
+ * JIT_INTERPRET, and the interpreter executes it instead.  Taken
+ * branches return the plain destination slot, which may be another
+ * compiled block.
+ *
+ * When counting, each pass through a block adds its length to the
+ * retired instructions up front, and every way out of the block subtracts
+ * the instructions it skipped.  A block that loops to itself also leaves
+ * once the retired instructions reach the limit in jit_state_t, so that
+ * the interpreter can enforce a budget.
+ *
+ * Addresses are turned into slots by rotating them right by two, which
+ * leaves unaligned addresses out of bounds, see slot() in machine.cpp.
+ */
+
+namespace {
+
+class emitter {
+  struct pending_t {
+    size_t at;  // offset of rel32
+    int32_t n;  // slot to exit with
+    int done;   // instructions executed before it
+  };
+
+  std::vector<uint8_t> out;
+  std::vector<pending_t> exits;
+
+  // offsets of instruction counts to patch, and instructions done there
+  std::vector<std::pair<size_t, int> > counts;
+  bool counting;
+
+  void count_fixup(int done)
+  {
+    counts.push_back(std::make_pair(pos(), done));
+    imm32(0);
+  }
+
+public:
+  emitter(bool count) : out(), exits(), counts(), counting(count)
+  {
+  }
+
+  size_t pos() const
+  {
+    return out.size();
+  }
+
+  const std::vector<uint8_t>& code() const
+  {
+    return out;
+  }
+
+  void bytes(const char* s, size_t n)
+  {
+    out.insert(out.end(), s, s + n);
+  }
+
+  void byte(int n)
+  {
+    out.push_back(n & 0xff);
+  }
+
+  void imm32(int32_t n)
+  {
+    for ( int i=0; i<4; ++i )
+      out.push_back((static_cast<uint32_t>(n) >> (8*i)) & 0xff);
+  }
+
+  void patch32(size_t at, int32_t n)
+  {
+    for ( int i=0; i<4; ++i )
+      out[at+i] = (static_cast<uint32_t>(n) >> (8*i)) & 0xff;
+  }
+
+  // point the rel32 at `at` to `target`
+  void patch(size_t at, size_t target)
+  {
+    patch32(at, static_cast<int32_t>(target - (at + 4)));
+  }
+
+  // count a pass through a block
+  void count_block()
+  {
+    if ( counting ) {
+      bytes("\x48\x81\x47\x38", 4);  // add qword [rdi+56], length
+      count_fixup(0);
+    }
+  }
+
+  // when counting, leave for slot `n` instead of looping once the limit
+  // in jit_state_t has been reached
+  void budget(int32_t n)
+  {
+    if ( counting ) {
+      bytes("\x48\x8b\x47\x38", 4);  // mov rax, [rdi+56]
+      bytes("\x48\x3b\x47\x40", 4);  // cmp rax, [rdi+64]
+      side_exit("\x0f\x83", n, -1);   // jae
+    }
+  }
+
+  // leave a block after `done` instructions, or before counting it if
+  // `done` is negative
+  void uncount(int done)
+  {
+    if ( counting && done >= 0 ) {
+      bytes("\x48\x81\x6f\x38", 4);  // sub qword [rdi+56], length-done
+      count_fixup(done);
+    }
+  }
+
+  // return to the interpreter, which continues at slot `n`
+  void exit(int32_t n, int done)
+  {
+    uncount(done);
+    bytes("\x48\x89\x37", 3);  // mov [rdi], rsi
+    out.push_back(0xb8);       // mov eax, n | JIT_INTERPRET
+    imm32(n | JIT_INTERPRET);
+    out.push_back(0xc3);       // ret
+  }
+
+  // jcc rel32 to a side exit returning slot `n`
+  void side_exit(const char* jcc, int32_t n, int done)
+  {
+    bytes(jcc, 2);
+    pending_t p = { pos(), n, done };
+    exits.push_back(p);
+    imm32(0);
+  }
+
+  // emit the side exits of a block of `length` instructions
+  void finish(int length)
+  {
+    for ( size_t n=0; n<exits.size(); ++n ) {
+      patch(exits[n].at, pos());
+      exit(exits[n].n, exits[n].done);
+    }
+
+    for ( size_t n=0; n<counts.size(); ++n )
+      patch32(counts[n].first, length - counts[n].second);
+  }
+};
+
+}
+
+#define JAE "\x0f\x83"
+#define JB  "\x0f\x82"
+#define JNE "\x0f\x85"
+#define JE  "\x0f\x84"
+#define JL  "\x0f\x8c"
+
+#define EMIT(s) e.bytes(s, sizeof(s)-1)
+
+jit_block_t* jit_t::compile(int32_t start, const int32_t* memory)
+{
+  if ( buffer == NULL )
+    return NULL;
+
+  const int32_t W = sizeof(int32_t);
+  emitter e(count);
+
+  // load registers from jit_state_t
+  EMIT("\x48\x8b\x37");      // mov rsi, [rdi]
+  EMIT("\x48\x8b\x57\x08");  // mov rdx, [rdi+8]
+  EMIT("\x48\x8b\x4f\x10");  // mov rcx, [rdi+16]
+  EMIT("\x4c\x8b\x47\x18");  // mov r8, [rdi+24]
+  EMIT("\x44\x8b\x4f\x20");  // mov r9d, [rdi+32]
+
+  // the caller checks the stack on entry, so skip to the body
+  EMIT("\xe9");              // jmp body
+  size_t to_body = e.pos();
+  e.imm32(0);
+
+  // loop head: check that the stack can take another pass
+  size_t head = e.pos();
+  e.budget(start);
+  EMIT("\x48\x89\xf0");      // mov rax, rsi
+  EMIT("\x48\x2b\x47\x28");  // sub rax, [rdi+40]
+  EMIT("\x48\x3d");          // cmp rax, need
+  size_t need_at = e.pos();
+  e.imm32(0);
+  e.side_exit(JL, start, -1);
+  EMIT("\x48\x8b\x47\x30");  // mov rax, [rdi+48]
+  EMIT("\x48\x29\xf0");      // sub rax, rsi
+  EMIT("\x48\x3d");          // cmp rax, grow
+  size_t grow_at = e.pos();
+  e.imm32(0);
+  e.side_exit(JL, start, -1);
+
+  e.patch(to_body, e.pos());
+  e.count_block();
+
+  int32_t pc = start;
+  int depth = 0, lowest = 0, highest = 0;
+  int count = 0;
+  bool ended = false, jumped = false;
+
+#define EFFECT(pops, pushes) \
+  do { depth -= (pops); if ( depth < lowest ) lowest = depth; \
+       depth += (pushes); if ( depth > highest ) highest = depth; } while(0)
+
+  // address in eax to slot, or leave at pc if it is out of bounds
+#define SLOT() \
+  do { EMIT("\xc1\xc8\x02");          /* ror eax, 2 */ \
+       EMIT("\x44\x39\xc8");          /* cmp eax, r9d */ \
+       e.side_exit(JAE, pc, count); } while(0)
+
+  // taken branch with the destination slot in eax
+#define BRANCH() \
+  do { e.uncount(count + 1); \
+       EMIT("\x3d"); e.imm32(start);  /* cmp eax, start */ \
+       EMIT("\x0f\x84"); e.imm32(0);  /* je head */ \
+       e.patch(e.pos()-4, head); \
+       EMIT("\x48\x89\x37\xc3");      /* mov [rdi], rsi; ret */ \
+  } while(0)
+
+  while ( !jumped && count < MAX_BLOCK_INSTRUCTIONS
+          && static_cast<size_t>(pc + 2) < memsize )
+  {
+    switch ( memory[pc] ) {
+    default:
+      ended = true;
+      break;
+
+    case NOP:
+      break;
+
+    case PUSH:
+      EFFECT(0, 1);
+      EMIT("\xc7\x06");          // mov dword [rsi], imm
+      e.imm32(memory[pc + 1]);
+      EMIT("\x48\x83\xc6\x04");  // add rsi, 4
+      ++pc;
+      break;
+
+    case ADD:
+    case AND:
+    case OR:
+    case XOR:
+      EFFECT(2, 1);
+      EMIT("\x8b\x46\xfc");      // mov eax, [rsi-4]
+      switch ( memory[pc] ) {
+      case ADD: EMIT("\x01\x46\xf8"); break;  // add [rsi-8], eax
+      case AND: EMIT("\x21\x46\xf8"); break;  // and [rsi-8], eax
+      case OR:  EMIT("\x09\x46\xf8"); break;  // or  [rsi-8], eax
+      case XOR: EMIT("\x31\x46\xf8"); break;  // xor [rsi-8], eax
+      }
+      EMIT("\x48\x83\xee\x04");  // sub rsi, 4
+      break;
+
+    case SUB:
+      EFFECT(2, 1);
+      EMIT("\x8b\x46\xfc");      // mov eax, [rsi-4]
+      EMIT("\x2b\x46\xf8");      // sub eax, [rsi-8]
+      EMIT("\x89\x46\xf8");      // mov [rsi-8], eax
+      EMIT("\x48\x83\xee\x04");  // sub rsi, 4
+      break;
+
+    case MUL:
+      EFFECT(2, 1);
+      EMIT("\x8b\x46\xfc");      // mov eax, [rsi-4]
+      EMIT("\x0f\xaf\x46\xf8");  // imul eax, [rsi-8]
+      EMIT("\x89\x46\xf8");      // mov [rsi-8], eax
+      EMIT("\x48\x83\xee\x04");  // sub rsi, 4
+      break;
+
+    case DIV:
+    case MOD:
+      // division by zero is reported by the interpreter, and idiv would
+      // trap on INT32_MIN / -1, which wraps around in the interpreter
+      EFFECT(2, 1);
+      EMIT("\x44\x8b\x56\xfc");  // mov r10d, [rsi-4]
+      EMIT("\x45\x85\xd2");      // test r10d, r10d
+      e.side_exit(JE, pc, count);
+      EMIT("\x41\x83\xfa\xff");  // cmp r10d, -1
+      e.side_exit(JE, pc, count);
+      EMIT("\x8b\x46\xf8");      // mov eax, [rsi-8]
+      EMIT("\x49\x89\xd3");      // mov r11, rdx
+      EMIT("\x99");              // cdq
+      EMIT("\x41\xf7\xfa");      // idiv r10d
+      if ( memory[pc] == DIV )
+        EMIT("\x89\x46\xf8");    // mov [rsi-8], eax
+      else
+        EMIT("\x89\x56\xf8");    // mov [rsi-8], edx
+      EMIT("\x4c\x89\xda");      // mov rdx, r11
+      EMIT("\x48\x83\xee\x04");  // sub rsi, 4
+      break;
+
+    case SHL:
+    case SHR:
+    case SAR:
+      EFFECT(2, 1);
+      EMIT("\x49\x89\xca");      // mov r10, rcx
+      EMIT("\x8b\x4e\xfc");      // mov ecx, [rsi-4]
+      switch ( memory[pc] ) {
+      case SHL: EMIT("\xd3\x66\xf8"); break;  // shl dword [rsi-8], cl
+      case SHR: EMIT("\xd3\x6e\xf8"); break;  // shr dword [rsi-8], cl
+      case SAR: EMIT("\xd3\x7e\xf8"); break;  // sar dword [rsi-8], cl
+      }
+      EMIT("\x4c\x89\xd1");      // mov rcx, r10
+      EMIT("\x48\x83\xee\x04");  // sub rsi, 4
+      break;
+
+    case LT:
+    case GT:
+    case EQ:
+      EFFECT(2, 1);
+      EMIT("\x8b\x46\xfc");      // mov eax, [rsi-4]
+      EMIT("\x45\x31\xd2");      // xor r10d, r10d
+      EMIT("\x39\x46\xf8");      // cmp [rsi-8], eax
+      switch ( memory[pc] ) {
+      case LT: EMIT("\x41\x0f\x9c\xc2"); break;  // setl r10b
+      case GT: EMIT("\x41\x0f\x9f\xc2"); break;  // setg r10b
+      case EQ: EMIT("\x41\x0f\x94\xc2"); break;  // sete r10b
+      }
+      EMIT("\x44\x89\x56\xf8");  // mov [rsi-8], r10d
+      EMIT("\x48\x83\xee\x04");  // sub rsi, 4
+      break;
+
+    case NOT:
+      EFFECT(1, 1);
+      EMIT("\x31\xc0");          // xor eax, eax
+      EMIT("\x83\x7e\xfc\x00");  // cmp dword [rsi-4], 0
+      EMIT("\x0f\x94\xc0");      // sete al
+      EMIT("\x89\x46\xfc");      // mov [rsi-4], eax
+      break;
+
+    case COMPL:
+      EFFECT(1, 1);
+      EMIT("\xf7\x56\xfc");      // not dword [rsi-4]
+      break;
+
+    case DUP:
+      EFFECT(1, 2);
+      EMIT("\x8b\x46\xfc");      // mov eax, [rsi-4]
+      EMIT("\x89\x06");          // mov [rsi], eax
+      EMIT("\x48\x83\xc6\x04");  // add rsi, 4
+      break;
+
+    case DROP:
+      EFFECT(1, 0);
+      EMIT("\x48\x83\xee\x04");  // sub rsi, 4
+      break;
+
+    case SWAP:
+      EFFECT(2, 2);
+      EMIT("\x8b\x46\xfc");      // mov eax, [rsi-4]
+      EMIT("\x44\x8b\x56\xf8");  // mov r10d, [rsi-8]
+      EMIT("\x44\x89\x56\xfc");  // mov [rsi-4], r10d
+      EMIT("\x89\x46\xf8");      // mov [rsi-8], eax
+      break;
+
+    case ROL3:
+      EFFECT(3, 3);
+      EMIT("\x8b\x46\xf4");      // mov eax, [rsi-12]
+      EMIT("\x44\x8b\x56\xf8");  // mov r10d, [rsi-8]
+      EMIT("\x44\x8b\x5e\xfc");  // mov r11d, [rsi-4]
+      EMIT("\x44\x89\x56\xf4");  // mov [rsi-12], r10d
+      EMIT("\x44\x89\x5e\xf8");  // mov [rsi-8], r11d
+      EMIT("\x89\x46\xfc");      // mov [rsi-4], eax
+      break;
+
+    case LOAD:
+      EFFECT(1, 1);
+      EMIT("\x8b\x46\xfc");      // mov eax, [rsi-4]
+      SLOT();
+      EMIT("\x8b\x04\x82");      // mov eax, [rdx+rax*4]
+      EMIT("\x89\x46\xfc");      // mov [rsi-4], eax
+      break;
+
+    case STOR:
+      // writes to address zero or into compiled code are left to the
+      // interpreter, which knows how to invalidate them
+      EFFECT(2, 0);
+      EMIT("\x8b\x46\xfc");      // mov eax, [rsi-4]
+      SLOT();
+      EMIT("\x85\xc0");          // test eax, eax
+      e.side_exit(JE, pc, count);
+      EMIT("\x80\x3c\x01\x00");  // cmp byte [rcx+rax], 0
+      e.side_exit(JNE, pc, count);
+      EMIT("\x44\x8b\x56\xf8");  // mov r10d, [rsi-8]
+      EMIT("\x44\x89\x14\x82");  // mov [rdx+rax*4], r10d
+
+      // invalidate the slots that may decode differently now; entries
+      // in the decoded cache are 8 bytes, one per slot, and there is
+      // room for CODE_SPAN of them before slot zero
+      EMIT("\x41\xc7\x04\xc0\x00\x00\x00\x00");  // mov [r8+rax*8], 0
+      for ( int n=1; n<CODE_SPAN; ++n ) {
+        EMIT("\x41\xc7\x44\xc0");                  // mov [r8+rax*8-n*8], 0
+        e.byte(-n*8);
+        e.imm32(0);
+      }
+      EMIT("\x48\x83\xee\x08");  // sub rsi, 8
+      break;
+
+    case JZ:
+    case JNZ: {
+      EFFECT(2, 0);
+      EMIT("\x8b\x46\xfc");      // mov eax, [rsi-4]
+      EMIT("\x85\xc0");          // test eax, eax
+
+      if ( memory[pc] == JZ )
+        EMIT("\x0f\x85");        // jnz not_taken
+      else
+        EMIT("\x0f\x84");        // jz not_taken
+
+      size_t not_taken = e.pos();
+      e.imm32(0);
+
+      EMIT("\x8b\x46\xf8");      // mov eax, [rsi-8]
+      SLOT();
+      EMIT("\x48\x83\xee\x08");  // sub rsi, 8
+      BRANCH();
+
+      e.patch(not_taken, e.pos());
+      EMIT("\x48\x83\xee\x08");  // sub rsi, 8
+      break;
+    }
+
+    case JMP:
+      // jumping to itself means halt, so let the interpreter do that
+      EFFECT(1, 0);
+      EMIT("\x8b\x46\xfc");      // mov eax, [rsi-4]
+      SLOT();
+      EMIT("\x3d");              // cmp eax, pc
+      e.imm32(pc);
+      e.side_exit(JE, pc, count);
+      EMIT("\x48\x83\xee\x04");  // sub rsi, 4
+      BRANCH();
+      jumped = true;
+      break;
+    }
+
+    if ( ended )
+      break;
+
+    ++count;
+    ++pc;
+  }
+
+#undef EFFECT
+#undef SLOT
+#undef BRANCH
+
+  if ( count < MIN_BLOCK_INSTRUCTIONS )
+    return NULL;
+
+  // fall off the end of the block
+  if ( !jumped )
+    e.exit(pc, count);
+
+  e.finish(count);
+  e.patch32(need_at, -lowest * W);
+  e.patch32(grow_at, highest * W);
+
+  const std::vector<uint8_t>& code = e.code();
+
+  if ( code.size() > MAX_BLOCK_CODE )
+    return NULL;
+
+  if ( used + code.size() > BUFFER_SIZE )
+    flush();
+
+  if ( mprotect(buffer, BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0 )
+    return NULL;
+
+  uint8_t *fn = buffer + used;
+  memcpy(fn, &code[0], code.size());
+  used += (code.size() + 15) & ~15;
+
+  mprotect(buffer, BUFFER_SIZE, PROT_READ | PROT_EXEC);
+
+  jit_block_t *b = new jit_block_t;
+  b->start = start;
+  b->end = pc;
+  b->need = -lowest;
+  b->grow = highest;
+  b->fn = reinterpret_cast<native_fn>(fn);
+
+  for ( int32_t n = start; n < pc; ++n )
+    if ( map[n] != UINT8_MAX )
+      ++map[n];
+
+  blocks[start] = b;
+  all.push_back(b);
+  return b;
+}
+
+#undef EMIT
+
+#endif
@@ -0,0 +1,104 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <ctype.h>
+#include "label.hpp"
+
+// toupper() of a byte, which may be above 0x7f
+static char upper_case(char c)
+{
+  return static_cast<char>(toupper(static_cast<unsigned char>(c)));
+}
+
+// FNV-1a of the name in upper case
+uint32_t label_table_t::hash(const char* name, size_t length)
+{
+  uint32_t h = 2166136261u;
+
+  for ( size_t n=0; n < length; ++n ) {
+    h ^= static_cast<unsigned char>(upper_case(name[n]));
+    h *= 16777619u;
+  }
+
+  return h;
+}
+
+bool label_table_t::same(const std::string& upper, const char* name,
+                         size_t length)
+{
+  if ( upper.length() != length )
+    return false;
+
+  for ( size_t n=0; n < length; ++n )
+    if ( upper[n] != upper_case(name[n]) )
+      return false;
+
+  return true;
+}
+
+label_table_t::label_table_t() :
+  labels(),
+  slots(16, -1)
+{
+}
+
+// The slot holding the name, or the empty slot where it would go
+size_t label_table_t::find_slot(const char* name, size_t length) const
+{
+  const size_t mask = slots.size() - 1;
+  size_t s = hash(name, length) & mask;
+
+  while ( slots[s] >= 0 && !same(labels[slots[s]].name, name, length) )
+    s = (s + 1) & mask;
+
+  return s;
+}
+
+// Doubles the table, which is kept at most half full
+void label_table_t::grow()
+{
+  std::vector<int32_t> old(slots.size()*2, -1);
+  slots.swap(old);
+
+  for ( size_t n=0; n < labels.size(); ++n ) {
+    const std::string& name = labels[n].name;
+    slots[find_slot(name.data(), name.length())] = n;
+  }
+}
+
+bool label_table_t::add(const char* name, size_t length, int32_t pos)
+{
+  size_t s = find_slot(name, length);
+
+  if ( slots[s] >= 0 )
+    return false;
+
+  std::string upper(name, length);
+
+  for ( size_t n=0; n < length; ++n )
+    upper[n] = upper_case(upper[n]);
+
+  slots[s] = labels.size();
+  labels.push_back(label_t(upper, pos));
+
+  if ( 2*labels.size() > slots.size() )
+    grow();
+
+  return true;
+}
+
+int32_t label_table_t::find(const char* name, size_t length) const
+{
+  const int32_t i = slots[find_slot(name, length)];
+  return i < 0 ? -1 : labels[i].pos;
+}
+
+const std::vector<label_t>& label_table_t::all() const
+{
+  return labels;
+}
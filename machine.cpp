@@ -7,255 +7,2107 @@
  */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <strings.h>
+#include <errno.h>
 #include <memory.h>
+#include <wchar.h>
+#include <unistd.h>
+#include <time.h>
+#include <new>
+#include <algorithm>
 #include "machine.hpp"
+#include "arith.hpp"
 #include "label.hpp"
-#include "upper.hpp"
+#include "pages.hpp"
+#include "vecops.hpp"
 
-machine_t::machine_t(
-  const machine_t& p,
+#if defined(__unix__) || defined(__APPLE__)
+# define HAVE_MMAP
+# include <sys/mman.h>
+#endif
+
+#if defined(HAVE_MMAP) && defined(__linux__) && defined(MFD_CLOEXEC)
+# define HAVE_MEMFD
+# include <unistd.h>
+#endif
+
+// Jumps to an address before it is compiled to native code
+static const int JIT_THRESHOLD = 1000;
+
+// Default number of entries in the data and IP stacks
+static const size_t STACK_CAPACITY = 64*1024;
+
+// Entries the stacks start out with; they grow up to their capacity
+static const size_t STACK_INITIAL = 256;
+
+// Unused entries before the decoded instruction cache, so that stores to
+// low addresses can invalidate CODE_SPAN entries without checking
+static const size_t CODE_PAD = CODE_SPAN;
+
+/*
+ * Memory is an array of words, while addresses count bytes.  This maps an
+ * address to its word slot.  The low bits are rotated to the top, so that
+ * an unaligned address maps outside of memory and a single bounds check
+ * catches both.
+ */
+template<typename word_t>
+inline typename basic_machine_t<word_t>::uword_t
+basic_machine_t<word_t>::slot(word_t adr)
+{
+  const int SHIFT = sizeof(word_t) == 8 ? 3 : 2;
+  const uword_t a = static_cast<uword_t>(adr);
+  return a >> SHIFT | a << (8*sizeof(word_t) - SHIFT);
+}
+
+/*
+ * Memory comes from page_alloc(), so that pages that are never touched
+ * cost nothing and read as zero, which is NOP.  Clearing it maps fresh
+ * pages over the old ones instead of writing to all of them.
+ */
+template<typename word_t>
+static word_t* map_memory(size_t words)
+{
+  return static_cast<word_t*>(page_alloc(words*sizeof(word_t)));
+}
+
+template<typename word_t>
+static void clear_memory(word_t* p, size_t words)
+{
+#ifdef HAVE_MMAP
+  if ( mmap(p, words*sizeof(word_t), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED )
+    return;
+#endif
+
+  memset(p, NOP, words*sizeof(word_t));
+}
+
+template<typename word_t>
+static void unmap_memory(word_t* p, size_t words)
+{
+  page_free(p, words*sizeof(word_t));
+}
+
+// Entries to allocate for a stack of at most `capacity` holding `depth`
+static size_t stack_size_for(size_t depth, size_t capacity)
+{
+  return std::min(capacity, std::max(depth, STACK_INITIAL));
+}
+
+/*
+ * Doubles the entries allocated for a stack, up to its capacity, keeping
+ * the first `keep`.  Returns false if it is as large as it may get.
+ */
+template<typename word_t>
+static bool grow_stack(word_t*& s, size_t& size, size_t capacity,
+                       size_t keep)
+{
+  if ( size >= capacity )
+    return false;
+
+  const size_t n = std::min(capacity, 2*size);
+  word_t *t = new word_t[n + 1];
+
+  memcpy(t, s, keep*sizeof(word_t));
+  delete[](s);
+  s = t;
+  size = n;
+  return true;
+}
+
+#ifdef HAVE_MEMFD
+// Privately maps memory from a snapshot file, over `at` if it is not NULL
+template<typename word_t>
+static word_t* map_file(int fd, size_t words, word_t* at)
+{
+  void *p = mmap(at, words*sizeof(word_t), PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | (at ? MAP_FIXED : 0), fd, 0);
+
+  if ( p == MAP_FAILED )
+    throw std::bad_alloc();
+
+  return static_cast<word_t*>(p);
+}
+
+static bool is_zero(const char* p, size_t n)
+{
+  return p[0] == 0 && memcmp(p, p + 1, n - 1) == 0;
+}
+
+// Writes memory to a file, leaving holes for pages that are all NOP
+template<typename word_t>
+static bool write_pages(int fd, const word_t* memory, size_t words)
+{
+  const char *p = reinterpret_cast<const char*>(memory);
+  const size_t bytes = words*sizeof(word_t);
+  const size_t page = sysconf(_SC_PAGESIZE);
+  size_t run = 0; // start of pages not yet written
+
+  for ( size_t at = 0; at <= bytes; at += page ) {
+    size_t n = at < bytes ? std::min(page, bytes - at) : 0;
+
+    if ( n > 0 && !is_zero(p + at, n) )
+      continue;
+
+    for ( size_t done = run; done < at; ) {
+      ssize_t w = pwrite(fd, p + done, at - done, done);
+
+      if ( w <= 0 )
+        return false;
+
+      done += w;
+    }
+
+    run = at + n;
+  }
+
+  return true;
+}
+#endif
+
+template<typename word_t>
+basic_snapshot_t<word_t>::basic_snapshot_t(basic_machine_t<word_t>& m) :
+  fd(-1),
+  copy(NULL),
+  memsize(m.memsize),
+  stack(m.stack, m.stack + m.stack_depth + 1),
+  stack_capacity(m.stack_capacity),
+  stackip(m.stackip, m.stackip + m.stackip_depth),
+  stackip_capacity(m.stackip_capacity),
+  labels(m.labels),
+  ip(m.ip),
+  running(m.running),
+  jit_threshold(m.jit_threshold),
+  fin(m.fin),
+  fout(m.fout),
+  output_policy(m.output_policy)
+{
+#ifdef HAVE_MEMFD
+  fd = memfd_create("stack-machine", MFD_CLOEXEC);
+
+  if ( fd != -1 && ftruncate(fd, memsize*sizeof(word_t)) == 0
+                && write_pages(fd, m.memory, memsize) )
+  {
+    // the machine can share the pages as well
+    map_file(fd, memsize, m.memory);
+    return;
+  }
+
+  if ( fd != -1 )
+    close(fd);
+
+  fd = -1;
+#endif
+
+  copy = static_cast<word_t*>(malloc(memsize*sizeof(word_t)));
+
+  if ( copy == NULL )
+    throw std::bad_alloc();
+
+  memcpy(copy, m.memory, memsize*sizeof(word_t));
+}
+
+template<typename word_t>
+basic_snapshot_t<word_t>::~basic_snapshot_t()
+{
+#ifdef HAVE_MEMFD
+  if ( fd != -1 )
+    close(fd);
+#endif
+
+  free(copy);
+}
+
+// Copies memory from a snapshot, over `at` if it is not NULL
+template<typename word_t>
+word_t* basic_machine_t<word_t>::map_snapshot(
+  const basic_snapshot_t<word_t>& s, word_t* at)
+{
+#ifdef HAVE_MEMFD
+  if ( s.fd != -1 )
+    return map_file(s.fd, s.memsize, at);
+#endif
+
+  if ( at == NULL )
+    at = map_memory<word_t>(s.memsize);
+
+  memcpy(at, s.copy, s.memsize*sizeof(word_t));
+  return at;
+}
+
+template<typename word_t>
+basic_machine_t<word_t>::basic_machine_t(
+  const basic_machine_t<word_t>& p,
   void (*error_callback)(const char*))
 :
-  stack(p.stack),
-  stackip(p.stackip),
+  stack(new word_t[stack_size_for(p.stack_depth, p.stack_capacity) + 1]),
+  stack_capacity(p.stack_capacity),
+  stack_size(stack_size_for(p.stack_depth, p.stack_capacity)),
+  stack_depth(p.stack_depth),
+  stackip(new word_t[stack_size_for(p.stackip_depth, p.stackip_capacity)
+                     + 1]),
+  stackip_capacity(p.stackip_capacity),
+  stackip_size(stack_size_for(p.stackip_depth, p.stackip_capacity)),
+  stackip_depth(p.stackip_depth),
   labels(p.labels),
   memsize(p.memsize),
-  memory(new int32_t[p.memsize]),
+  memory(map_memory<word_t>(p.memsize)),
+  code(NULL),
+  jit(NULL),
+  jit_threshold(p.jit_threshold),
+  counting(p.counting),
+  retired(p.retired),
+  profile(NULL),
+  stats(NULL),
   ip(p.ip),
   fin(p.fin),
   fout(p.fout),
+  output_policy(p.output_policy),
+  outbuf(NULL),
   running(p.running),
   error_cb(error_callback)
 {
-  memmove(memory, p.memory, memsize*sizeof(int32_t));
+  memcpy(memory, p.memory, memsize*sizeof(word_t));
+  memcpy(stack, p.stack, (stack_depth + 1)*sizeof(word_t));
+  memcpy(stackip, p.stackip, stackip_depth*sizeof(word_t));
 }
 
-machine_t::machine_t(const size_t memory_size,
+template<typename word_t>
+basic_machine_t<word_t>::basic_machine_t(
+  const basic_snapshot_t<word_t>& s,
+  void (*error_callback)(const char*))
+:
+  stack(new word_t[stack_size_for(s.stack.size() - 1, s.stack_capacity)
+                   + 1]),
+  stack_capacity(s.stack_capacity),
+  stack_size(stack_size_for(s.stack.size() - 1, s.stack_capacity)),
+  stack_depth(s.stack.size() - 1),
+  stackip(new word_t[stack_size_for(s.stackip.size(), s.stackip_capacity)
+                     + 1]),
+  stackip_capacity(s.stackip_capacity),
+  stackip_size(stack_size_for(s.stackip.size(), s.stackip_capacity)),
+  stackip_depth(s.stackip.size()),
+  labels(s.labels),
+  memsize(s.memsize),
+  memory(map_snapshot(s, NULL)),
+  code(NULL),
+  jit(NULL),
+  jit_threshold(s.jit_threshold),
+  counting(false),
+  retired(0),
+  profile(NULL),
+  stats(NULL),
+  ip(s.ip),
+  fin(s.fin),
+  fout(s.fout),
+  output_policy(static_cast<output_policy_t>(s.output_policy)),
+  outbuf(NULL),
+  running(s.running),
+  error_cb(error_callback)
+{
+  std::copy(s.stack.begin(), s.stack.end(), stack);
+  std::copy(s.stackip.begin(), s.stackip.end(), stackip);
+}
+
+template<typename word_t>
+basic_machine_t<word_t>::basic_machine_t(const size_t memory_words,
   FILE* out,
   FILE* in,
   void (*error_callback)(const char*))
 :
-  stack(),
-  stackip(),
+  stack(new word_t[STACK_INITIAL + 1]),
+  stack_capacity(STACK_CAPACITY),
+  stack_size(STACK_INITIAL),
+  stack_depth(0),
+  stackip(new word_t[STACK_INITIAL + 1]),
+  stackip_capacity(STACK_CAPACITY),
+  stackip_size(STACK_INITIAL),
+  stackip_depth(0),
   labels(),
-  memsize(memory_size),
-  memory(new int32_t[memory_size]),
+  memsize(memory_words),
+  memory(map_memory<word_t>(memory_words)),
+  code(NULL),
+  jit(NULL),
+  jit_threshold(JIT_THRESHOLD),
+  counting(false),
+  retired(0),
+  profile(NULL),
+  stats(NULL),
   ip(0),
   fin(in),
   fout(out),
+  output_policy(OUTPUT_AUTO),
+  outbuf(NULL),
   running(true),
   error_cb(error_callback)
 {
-  reset();
+  stack[0] = 0;
 }
 
-machine_t::machine_t(void (*error_callback)(const char*))
+template<typename word_t>
+basic_machine_t<word_t>::basic_machine_t(
+  void (*error_callback)(const char*),
+  const size_t memory_words)
 :
-  stack(),
-  stackip(),
+  stack(new word_t[STACK_INITIAL + 1]),
+  stack_capacity(STACK_CAPACITY),
+  stack_size(STACK_INITIAL),
+  stack_depth(0),
+  stackip(new word_t[STACK_INITIAL + 1]),
+  stackip_capacity(STACK_CAPACITY),
+  stackip_size(STACK_INITIAL),
+  stackip_depth(0),
   labels(),
-  memsize(1000*1024*sizeof(int32_t)),
-  memory(new int32_t[memsize]),
+  memsize(memory_words),
+  memory(map_memory<word_t>(memory_words)),
+  code(NULL),
+  jit(NULL),
+  jit_threshold(JIT_THRESHOLD),
+  counting(false),
+  retired(0),
+  profile(NULL),
+  stats(NULL),
   ip(0),
   fin(stdin),
   fout(stdout),
+  output_policy(OUTPUT_AUTO),
+  outbuf(NULL),
   running(true),
   error_cb(error_callback)
 {
-  reset();
+  stack[0] = 0;
 }
 
-machine_t& machine_t::operator=(const machine_t& p)
+template<typename word_t>
+basic_machine_t<word_t>& basic_machine_t<word_t>::operator=(
+  const basic_machine_t& p)
 {
   if ( &p == this )
     return *this;
 
-  delete[](memory);
+  // before memsize changes, which gives the size of the decode cache
+  drop_code();
+
+  if ( memsize != p.memsize ) {
+    unmap_memory(memory, memsize);
+    memory = map_memory<word_t>(p.memsize);
+  }
 
-  stack = p.stack;
-  stackip = p.stackip;
+  delete[](stack);
+  delete[](stackip);
+
+  stack_capacity = p.stack_capacity;
+  stack_size = stack_size_for(p.stack_depth, stack_capacity);
+  stack_depth = p.stack_depth;
+  stack = new word_t[stack_size + 1];
+  memcpy(stack, p.stack, (stack_depth + 1)*sizeof(word_t));
+  stackip_capacity = p.stackip_capacity;
+  stackip_size = stack_size_for(p.stackip_depth, stackip_capacity);
+  stackip_depth = p.stackip_depth;
+  stackip = new word_t[stackip_size + 1];
+  memcpy(stackip, p.stackip, stackip_depth*sizeof(word_t));
   labels = p.labels;
   memsize = p.memsize;
-  memory = new int32_t[memsize];
-  memcpy(memory, p.memory, memsize*sizeof(int32_t));
+  memcpy(memory, p.memory, memsize*sizeof(word_t));
+  jit_threshold = p.jit_threshold;
+  counting = p.counting;
+  retired = p.retired;
   ip = p.ip;
+  flush_output();
   fin = p.fin;
   fout = p.fout;
+  output_policy = p.output_policy;
+  configure_output();
   running = p.running;
   error_cb = p.error_cb;
 
   return *this;
 }
 
-void machine_t::reset()
+template<typename word_t>
+void basic_machine_t<word_t>::reset()
 {
-  memset(memory, NOP, memsize*sizeof(int32_t));
-  stack.clear();
+  clear_memory(memory, memsize);
+  drop_code();
+  stack[0] = 0;
+  stack_depth = 0;
   ip = 0;
 }
 
-machine_t::~machine_t()
+/*
+ * Returns to the state of a snapshot, keeping the error callback, the
+ * input and output streams and the JIT threshold.
+ */
+template<typename word_t>
+void basic_machine_t<word_t>::rollback(const basic_snapshot_t<word_t>& s)
+{
+  // before memsize changes, which gives the size of the decode cache
+  drop_code();
+
+  if ( memsize != s.memsize ) {
+    unmap_memory(memory, memsize);
+    memory = NULL;
+    memory = map_snapshot(s, NULL);
+    memsize = s.memsize;
+  } else
+    map_snapshot(s, memory);
+
+  if ( stack_capacity != s.stack_capacity
+       || stackip_capacity != s.stackip_capacity )
+    set_stack_capacity(s.stack_capacity, s.stackip_capacity);
+
+  stack_depth = s.stack.size() - 1;
+  stackip_depth = s.stackip.size();
+
+  while ( stack_size < stack_depth &&
+          grow_stack(stack, stack_size, stack_capacity, 0) )
+    ;
+
+  while ( stackip_size < stackip_depth &&
+          grow_stack(stackip, stackip_size, stackip_capacity, 0) )
+    ;
+
+  std::copy(s.stack.begin(), s.stack.end(), stack);
+  std::copy(s.stackip.begin(), s.stackip.end(), stackip);
+  labels = s.labels;
+  ip = s.ip;
+  running = s.running;
+}
+
+template<typename word_t>
+basic_machine_t<word_t>::~basic_machine_t()
+{
+  flush_output();
+  delete outbuf;
+  delete profile;
+  delete stats;
+  unmap_memory(memory, memsize);
+  delete[](stack);
+  delete[](stackip);
+  drop_code();
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::set_stack_capacity(size_t data, size_t ip_stack)
+{
+  if ( stack_depth > data )
+    stack_depth = data;
+
+  if ( stackip_depth > ip_stack )
+    stackip_depth = ip_stack;
+
+  const size_t size = stack_size_for(stack_depth, data);
+  const size_t ip_size = stack_size_for(stackip_depth, ip_stack);
+  word_t *s = new word_t[size + 1];
+  word_t *t = new word_t[ip_size + 1];
+
+  memcpy(s, stack, (stack_depth + 1)*sizeof(word_t));
+  memcpy(t, stackip, stackip_depth*sizeof(word_t));
+
+  delete[](stack);
+  delete[](stackip);
+
+  stack = s;
+  stack_capacity = data;
+  stack_size = size;
+  stackip = t;
+  stackip_capacity = ip_stack;
+  stackip_size = ip_size;
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::drop_code()
+{
+  if ( code )
+    page_free(code - CODE_PAD, (CODE_PAD + memsize)*sizeof(decoded_t));
+
+  code = NULL;
+  delete jit;
+  jit = NULL;
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::invalidate(uint32_t n)
+{
+  // the cell may be the immediate of a PUSH or PUSHIP, or part of a
+  // fused instruction, decoded at one of the cells before it
+  for ( int i = 0; i < CODE_SPAN; ++i )
+    code[static_cast<int32_t>(n) - i].op = 0;
+
+  if ( n == 0 )
+    code[memsize - 1].op = 0;
+
+  if ( jit && jit->covers(n) )
+    jit->invalidate(n);
+}
+
+// Invalidates `count` cells from slot `first` at once
+template<typename word_t>
+void basic_machine_t<word_t>::invalidate(uint32_t first, size_t count)
+{
+  if ( count == 0 )
+    return;
+
+  decoded_t *p = code + first - (CODE_SPAN - 1);
+  memset(p, 0, (count + CODE_SPAN - 1)*sizeof(decoded_t));
+
+  if ( first == 0 )
+    code[memsize - 1].op = 0;
+
+  if ( jit )
+    for ( size_t n = first; n < first + count; ++n )
+      if ( jit->covers(n) )
+        jit->invalidate(n);
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::error(const char* s) const
+{
+  // the callback may well exit
+  flush_output();
+
+  if ( error_cb )
+    error_cb(s);
+}
+
+/*
+ * Output is collected in `outbuf` and written to `fout` according to
+ * the output policy.  There is always room for a formatted number after
+ * the limit, so writing to the buffer needs no checks.
+ */
+template<typename word_t>
+typename basic_machine_t<word_t>::outbuf_t* basic_machine_t<word_t>::output()
+{
+  if ( outbuf == NULL ) {
+    outbuf = new outbuf_t;
+    outbuf->len = 0;
+    configure_output();
+  }
+
+  return outbuf;
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::configure_output()
+{
+  if ( outbuf == NULL )
+    return;
+
+  output_policy_t p = output_policy;
+
+  if ( p == OUTPUT_AUTO ) {
+    int fd = fout ? fileno(fout) : -1;
+    p = fd != -1 && isatty(fd) ? OUTPUT_LINE : OUTPUT_FULL;
+  }
+
+  outbuf->limit = p == OUTPUT_UNBUFFERED ? 1 : sizeof(outbuf->data) - 24;
+  outbuf->lines = p == OUTPUT_LINE;
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::flush_output() const
+{
+  if ( outbuf == NULL || outbuf->len == 0 )
+    return;
+
+  fwrite(outbuf->data, 1, outbuf->len, fout);
+  fflush(fout);
+  outbuf->len = 0;
+}
+
+template<typename word_t>
+inline void basic_machine_t<word_t>::put(word_t c)
+{
+  outbuf->data[outbuf->len++] = static_cast<char>(c);
+
+  if ( outbuf->len >= outbuf->limit
+       || (static_cast<char>(c) == '\n' && outbuf->lines) )
+    flush_output();
+}
+
+// Same as printf("%u", n), or "%lu" for 64-bit words
+template<typename word_t>
+inline void basic_machine_t<word_t>::put_number(uword_t n)
+{
+  char s[20];
+  char *p = s + sizeof(s);
+
+  do {
+    *--p = '0' + n % 10;
+    n /= 10;
+  } while ( n != 0 );
+
+  size_t len = s + sizeof(s) - p;
+  memcpy(outbuf->data + outbuf->len, p, len);
+  outbuf->len += len;
+
+  if ( outbuf->len >= outbuf->limit )
+    flush_output();
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::push(const word_t& n)
+{
+  if ( stack_depth == stack_size &&
+       !grow_stack(stack, stack_size, stack_capacity, stack_depth + 1) )
+  {
+    error("Stack overflow");
+    return;
+  }
+
+  stack[++stack_depth] = n;
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::puship(const word_t& n)
+{
+  if ( stackip_depth == stackip_size &&
+       !grow_stack(stackip, stackip_size, stackip_capacity, stackip_depth) )
+  {
+    error("IP stack overflow");
+    return;
+  }
+
+  stackip[stackip_depth++] = n;
+}
+
+template<typename word_t>
+word_t basic_machine_t<word_t>::popip()
+{
+  if ( stackip_depth == 0 ) {
+    error("POP empty IP stack");
+    return 0;
+  }
+
+  return stackip[--stackip_depth];
+}
+
+template<typename word_t>
+word_t basic_machine_t<word_t>::pop()
+{
+  if ( stack_depth == 0 ) {
+    error("POP empty stack");
+    return 0;
+  }
+
+  return stack[stack_depth--];
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::check_bounds(word_t n, const char* msg) const
+{
+  if ( slot(n) >= memsize )
+    error(msg);
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::next()
+{
+  ip += sizeof(word_t);
+
+  if ( ip < 0 )
+    error("IP < 0");
+
+  if ( slot(ip) >= memsize )
+    ip = 0; // TODO: Halt instead of wrap-around?
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::prev()
+{
+  if ( ip == 0 )
+    error("prev() reached zero");
+
+  ip -= sizeof(word_t);
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::load(Op op)
+{
+  load(static_cast<word_t>(op));
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::load(word_t n)
+{
+  memory[slot(ip)] = n;
+
+  if ( code )
+    invalidate(slot(ip));
+
+  next();
+}
+
+/*
+ * The execution engine.
+ *
+ * This is semantically identical to calling exec() in a loop, but keeps
+ * the instruction pointer and the data stack pointer in locals and has
+ * all instruction handlers inlined.  With GCC and Clang, dispatch is done
+ * through computed gotos (direct threading); other compilers fall back to
+ * a plain switch.  Define NO_THREADED_CODE to force the switch.
+ *
+ * Instructions are not executed from `memory` directly, but from `code`,
+ * a cache holding the decoded handler and immediate operand of each cell.
+ * Cells are decoded lazily the first time they are executed, and every
+ * write to memory invalidates the cells it may affect, so self-modifying
+ * code keeps working.
+ *
+ * The decoder also fuses the sequences the compiler emits most often into
+ * single instructions:
+ *
+ *   PUSHIP <here+20> PUSH <adr> JMP   CALL, see compile_function_call()
+ *   PUSH <adr> JMP                    JMPI (or HALT if adr is the JMP)
+ *   PUSH <n> ADD                      ADDI
+ *   PUSH <adr> LOAD                   LOADA
+ *   PUSH <adr> STOR                   STORA
+ *
+ * A fused instruction is only decoded at its first cell, so jumping into
+ * the middle of one just decodes the plain instruction found there.
+ *
+ * On x86-64, addresses that are jumped to often are compiled to native
+ * code by jit_t, and entered from the jump instead of being interpreted.
+ *
+ * The loop is instantiated once for each combination of counting retired
+ * instructions (see count_instructions()), profiling (see set_profiling())
+ * and collecting statistics (see collect_stats()), so that each costs
+ * nothing when it is turned off.  Fused instructions count as the
+ * instructions they replace.  Profiling and statistics run without native
+ * code, since they look at every instruction.
+ *
+ * The instr_*() functions and exec() are still the reference
+ * implementation of each instruction.
+ */
+
+#if defined(__GNUC__) && !defined(NO_THREADED_CODE)
+# define THREADED_CODE
+#endif
+
+// Handler numbers used in the decoded instruction cache.  Zero means that
+// the cell has not been decoded, so a zeroed cache is empty.
+enum {
+  X_DECODE,
+  X_UNKNOWN,
+  X_NOP, X_ADD, X_SUB, X_AND, X_OR, X_XOR, X_NOT, X_IN, X_OUT, X_LOAD,
+  X_STOR, X_JMP, X_JZ, X_PUSH, X_DUP, X_SWAP, X_ROL3, X_OUTNUM, X_JNZ,
+  X_DROP, X_PUSHIP, X_POPIP, X_DROPIP, X_COMPL, X_READ, X_WRITE,
+  X_MUL, X_DIV, X_MOD, X_SHL, X_SHR, X_SAR, X_LT, X_GT, X_EQ,
+  X_VADD, X_VSUB, X_VAND, X_VOR, X_VXOR, X_VSUM, X_VMIN, X_VMAX, X_VDOT,
+  X_MEMCPY, X_MEMSET, X_MEMCMP, X_MEMCHR,
+  X_CALL, X_JMPI, X_HALT, X_ADDI, X_LOADA, X_STORA,
+  X_END
+};
+
+/*
+ * Native code works on 32-bit words, so no jit_t is made for machines with
+ * other words.  Their memory and stacks are still handed to one in
+ * execute(), in code that never runs for them.
+ */
+template<typename word_t>
+static int32_t* native_words(word_t* p)
+{
+  return reinterpret_cast<int32_t*>(p);
+}
+
+// Adds counts by handler to counts by opcode, splitting up fused
+// instructions
+static void tally(const uint64_t* handlers, uint64_t* ops)
+{
+  for ( int h = X_NOP; h < X_CALL; ++h )
+    ops[h - X_NOP] += handlers[h];
+
+  ops[NOP_END] += handlers[X_UNKNOWN];
+  ops[PUSHIP] += handlers[X_CALL];
+  ops[PUSH] += handlers[X_CALL] + handlers[X_JMPI] + handlers[X_HALT]
+             + handlers[X_ADDI] + handlers[X_LOADA] + handlers[X_STORA];
+  ops[JMP] += handlers[X_CALL] + handlers[X_JMPI] + handlers[X_HALT];
+  ops[ADD] += handlers[X_ADDI];
+  ops[LOAD] += handlers[X_LOADA];
+  ops[STOR] += handlers[X_STORA];
+}
+
+template<typename word_t>
+typename basic_machine_t<word_t>::decoded_t
+basic_machine_t<word_t>::decode(uint32_t n) const
+{
+  const word_t W = sizeof(word_t);
+  decoded_t d;
+  uword_t op = memory[n];
+
+  d.op = op < NOP_END ? static_cast<int32_t>(X_NOP + op) : X_UNKNOWN;
+  d.imm = 0;
+
+  if ( op == PUSH || op == PUSHIP )
+    d.imm = memory[n + 1 < memsize ? n + 1 : 0];
+
+  // look for fused instructions that fit without wrapping around; their
+  // immediates are stored as slots, not addresses
+  size_t left = memsize - n;
+
+  if ( op == PUSHIP && left >= 5
+       && d.imm == static_cast<word_t>((n + 5)*W)
+       && memory[n + 2] == PUSH && memory[n + 4] == JMP )
+  {
+    uword_t dst = slot(memory[n + 3]);
+
+    if ( dst < memsize && dst != n + 4 ) {
+      d.op = X_CALL;
+      d.imm = dst;
+    }
+  }
+  else if ( op == PUSH && left >= 3 ) {
+    uword_t dst = slot(d.imm);
+    bool inside = dst < memsize;
+
+    switch ( memory[n + 2] ) {
+    case JMP:
+      if ( dst == n + 2 )
+        d.op = X_HALT;
+      else if ( inside ) {
+        d.op = X_JMPI;
+        d.imm = dst;
+      }
+      break;
+    case ADD:
+      d.op = X_ADDI;
+      break;
+    case LOAD:
+      if ( inside ) {
+        d.op = X_LOADA;
+        d.imm = dst;
+      }
+      break;
+    case STOR:
+      if ( inside ) {
+        d.op = X_STORA;
+        d.imm = dst;
+      }
+      break;
+    }
+  }
+
+  return d;
+}
+
+// True if the last read from f failed only because it would have blocked.
+// The error is then cleared, so that the read can be retried.
+static bool would_block(FILE* f)
+{
+  if ( !ferror(f) || (errno != EAGAIN && errno != EWOULDBLOCK) )
+    return false;
+
+  clearerr(f);
+  return true;
+}
+
+template<typename word_t>
+template<int MODE>
+run_status_t basic_machine_t<word_t>::execute(int32_t start_address,
+                                               uint64_t budget)
+{
+  const bool BUDGETED = MODE & RUN_BUDGET;
+  const bool COUNTING = MODE & (RUN_COUNT | RUN_BUDGET);
+  const bool PROFILING = MODE & RUN_PROFILE;
+  const bool STATS = MODE & RUN_STATS;
+  const bool NATIVE = sizeof(word_t) == sizeof(int32_t);
+  const word_t W = sizeof(word_t);
+
+  const uint32_t words = memsize;
+  word_t *mem = memory;
+  const uword_t start = slot(start_address);
+  uword_t a;
+  word_t b;
+
+  if ( start >= words ) {
+    error("Start address out of bounds");
+    return STATUS_ERROR;
+  }
+
+  uint32_t pc = start;
+
+  if ( code == NULL )
+    code = static_cast<decoded_t*>(
+      page_alloc((CODE_PAD + memsize)*sizeof(decoded_t))) + CODE_PAD;
+
+  decoded_t *cache = code;
+
+  if ( jit && jit->counting() != COUNTING ) {
+    delete jit;
+    jit = NULL;
+  }
+
+  const bool interpret = PROFILING || STATS;
+
+  if ( jit == NULL && jit_threshold > 0 && NATIVE && jit_t::supported()
+       && !interpret )
+    jit = new jit_t(memsize, jit_threshold, COUNTING);
+
+  output();
+
+  jit_t *native = interpret ? NULL : jit;
+  profile_t *const prof = profile;
+  stats_t *const st = stats;
+
+  if ( PROFILING )
+    prof->start(memsize, labels.all(), stackip, stackip_depth);
+
+  uint64_t handlers[STATS ? X_END : 1];
+
+  if ( STATS ) {
+    st->start(memsize);
+    memset(handlers, 0, sizeof(handlers));
+  }
+
+  jit_state_t js = jit_state_t();
+
+  if ( native ) {
+    js.memory = native_words(mem);
+    js.map = native->codemap();
+    js.code = cache;
+    js.memsize = words;
+    js.limit = UINT64_MAX;
+  }
+
+  /*
+   * The top of the data stack is kept in `tos`, and the rest in `stack`,
+   * addressed through `sp`.  Element n lives at stack[n+1], so that the
+   * top element is stack[depth] and pushing onto an empty stack spills
+   * the (meaningless) tos into the unused stack[0].
+   */
+  word_t *sbase = stack;
+  ptrdiff_t scap = stack_size;
+  word_t *sp = sbase + stack_depth;
+  word_t tos = *sp;
+
+  word_t *rbase = stackip;
+  word_t *rlim = rbase + stackip_size;
+  word_t *rp = rbase + stackip_depth;
+
+  uint64_t count = 0;
+  run_status_t status = STATUS_HALTED;
+  ptrdiff_t depth = sp - sbase;
+  ptrdiff_t ipdepth = rp - rbase;
+
+  // the budget is checked at jumps, including wrapping around memory
+#define SPENT() \
+  (BUDGETED && count >= budget)
+
+  // pc is the slot of the current instruction, not its address
+#define NEXT() \
+  do { if ( ++pc == words ) { pc = 0; if ( SPENT() ) goto pause; } } while(0)
+
+#define SKIP(cells) \
+  do { \
+    pc += (cells); \
+    if ( pc >= words ) { pc = 0; if ( SPENT() ) goto pause; } \
+  } while(0)
+
+#define FAULT(msg) \
+  do { error(msg); status = STATUS_ERROR; goto out; } while(0)
+
+#define BOUNDS(n, msg) \
+  do { a = slot(n); if ( a >= words ) FAULT(msg); } while(0)
+
+#define NEED(n) \
+  do { if ( sp - sbase < (n) ) FAULT("POP empty stack"); } while(0)
+
+  // the stacks grow as they fill up, up to their capacity
+#define GROW() \
+  ( stack_depth = sp - sbase, \
+    grow_stack(stack, stack_size, stack_capacity, stack_depth + 1) && \
+    (sbase = stack, sp = sbase + stack_depth, scap = stack_size, true) )
+
+#define GROWIP() \
+  ( stackip_depth = rp - rbase, \
+    grow_stack(stackip, stackip_size, stackip_capacity, stackip_depth) && \
+    (rbase = stackip, rp = rbase + stackip_depth, \
+     rlim = rbase + stackip_size, true) )
+
+#define ROOM() \
+  do { \
+    if ( sp - sbase >= scap && !GROW() ) \
+      FAULT("Stack overflow"); \
+  } while(0)
+
+#define PUSHD(n) \
+  do { ROOM(); *sp++ = tos; tos = (n); } while(0)
+
+#define BRANCH() \
+  do { \
+    if ( SPENT() ) goto pause; \
+    if ( native ) goto enter_native; \
+    DISPATCH(); \
+  } while(0)
+
+#define RETIRE(n) \
+  do { if ( COUNTING ) count += (n); } while(0)
+
+  // counts the instruction in a slot, in profiling mode
+#define PROFILE(at) \
+  do { if ( PROFILING ) prof->hit((at), mem[at]); } while(0)
+
+  // takes back the counts for the instruction at pc, which will be
+  // dispatched again
+#define UNCOUNT() \
+  do { \
+    RETIRE(-1); \
+    if ( PROFILING ) prof->unhit(pc, mem[pc]); \
+    if ( STATS ) --handlers[cache[pc].op]; \
+  } while(0)
+
+  // leaves to wait for input, and to retry the instruction at pc
+#define WAIT() \
+  do { UNCOUNT(); status = STATUS_WAITING; goto out; } while(0)
+
+  // counts the next handler and the deepest stacks, when collecting stats
+#define TALLY() \
+  do { \
+    if ( STATS ) { \
+      ++handlers[cache[pc].op]; \
+      if ( sp - sbase > depth ) depth = sp - sbase; \
+      if ( rp - rbase > ipdepth ) ipdepth = rp - rbase; \
+    } \
+  } while(0)
+
+#ifdef THREADED_CODE
+  static const void* const table[X_END] = {
+    &&L_DECODE, &&L_UNKNOWN,
+    &&L_NOP, &&L_ADD, &&L_SUB, &&L_AND, &&L_OR, &&L_XOR, &&L_NOT, &&L_IN,
+    &&L_OUT, &&L_LOAD, &&L_STOR, &&L_JMP, &&L_JZ, &&L_PUSH, &&L_DUP,
+    &&L_SWAP, &&L_ROL3, &&L_OUTNUM, &&L_JNZ, &&L_DROP, &&L_PUSHIP,
+    &&L_POPIP, &&L_DROPIP, &&L_COMPL, &&L_READ, &&L_WRITE,
+    &&L_MUL, &&L_DIV, &&L_MOD, &&L_SHL, &&L_SHR, &&L_SAR, &&L_LT, &&L_GT,
+    &&L_EQ, &&L_VADD, &&L_VSUB, &&L_VAND, &&L_VOR, &&L_VXOR, &&L_VSUM,
+    &&L_VMIN, &&L_VMAX, &&L_VDOT, &&L_MEMCPY, &&L_MEMSET, &&L_MEMCMP,
+    &&L_MEMCHR,
+    &&L_CALL, &&L_JMPI, &&L_HALT, &&L_ADDI, &&L_LOADA, &&L_STORA
+  };
+
+# define TARGET(op) L_##op:
+# define DISPATCH() \
+  do { RETIRE(1); PROFILE(pc); TALLY(); goto *table[cache[pc].op]; } while(0)
+
+  DISPATCH();
+#else
+# define TARGET(op) case X_##op:
+# define DISPATCH() goto dispatch
+
+dispatch:
+  RETIRE(1);
+  PROFILE(pc);
+  TALLY();
+  switch ( cache[pc].op ) {
+#endif
+
+  TARGET(DECODE)
+    UNCOUNT();
+    cache[pc] = decode(pc);
+    DISPATCH();
+
+  TARGET(UNKNOWN)
+    FAULT("Unknown instruction");
+
+  TARGET(NOP)
+    NEXT();
+    DISPATCH();
+
+  TARGET(ADD)
+    NEED(2);
+    tos += *--sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(SUB)
+    NEED(2);
+    tos -= *--sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(AND)
+    NEED(2);
+    tos &= *--sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(OR)
+    NEED(2);
+    tos |= *--sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(XOR)
+    NEED(2);
+    tos ^= *--sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(NOT)
+    NEED(1);
+    tos = !tos;
+    NEXT();
+    DISPATCH();
+
+  TARGET(COMPL)
+    NEED(1);
+    tos = ~tos;
+    NEXT();
+    DISPATCH();
+
+  TARGET(MUL)
+    NEED(2);
+    tos = op_mul(*--sp, tos);
+    NEXT();
+    DISPATCH();
+
+  TARGET(DIV)
+    NEED(2);
+
+    if ( tos == 0 )
+      FAULT("Division by zero");
+
+    tos = op_div(*--sp, tos);
+    NEXT();
+    DISPATCH();
+
+  TARGET(MOD)
+    NEED(2);
+
+    if ( tos == 0 )
+      FAULT("Division by zero");
+
+    tos = op_mod(*--sp, tos);
+    NEXT();
+    DISPATCH();
+
+  TARGET(SHL)
+    NEED(2);
+    tos = op_shl(*--sp, tos);
+    NEXT();
+    DISPATCH();
+
+  TARGET(SHR)
+    NEED(2);
+    tos = op_shr(*--sp, tos);
+    NEXT();
+    DISPATCH();
+
+  TARGET(SAR)
+    NEED(2);
+    tos = op_sar(*--sp, tos);
+    NEXT();
+    DISPATCH();
+
+  TARGET(LT)
+    NEED(2);
+    tos = *--sp < tos;
+    NEXT();
+    DISPATCH();
+
+  TARGET(GT)
+    NEED(2);
+    tos = *--sp > tos;
+    NEXT();
+    DISPATCH();
+
+  TARGET(EQ)
+    NEED(2);
+    tos = *--sp == tos;
+    NEXT();
+    DISPATCH();
+
+  TARGET(VADD)
+  TARGET(VSUB)
+  TARGET(VAND)
+  TARGET(VOR)
+  TARGET(VXOR)
+    // d a b n
+    NEED(4);
+
+    if ( !vector(static_cast<Op>(cache[pc].op - X_NOP),
+                 sp[-3], sp[-2], sp[-1], tos) )
+      FAULT(OpStr[cache[pc].op - X_NOP]);
+
+    if ( STATS ) {
+      st->load(slot(sp[-2]), tos);
+      st->load(slot(sp[-1]), tos);
+      st->store(slot(sp[-3]), tos);
+    }
+
+    sp -= 4;
+    tos = *sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(VSUM)
+  TARGET(VMIN)
+  TARGET(VMAX)
+    // a n
+    NEED(2);
+
+    if ( !reduce(static_cast<Op>(cache[pc].op - X_NOP), sp[-1], tos, b) )
+      FAULT(OpStr[cache[pc].op - X_NOP]);
+
+    if ( STATS )
+      st->load(slot(sp[-1]), tos);
+
+    --sp;
+    tos = b;
+    NEXT();
+    DISPATCH();
+
+  TARGET(VDOT)
+    // a b n
+    NEED(3);
+
+    if ( !dot(sp[-2], sp[-1], tos, b) )
+      FAULT("VDOT");
+
+    if ( STATS ) {
+      st->load(slot(sp[-2]), tos);
+      st->load(slot(sp[-1]), tos);
+    }
+
+    sp -= 2;
+    tos = b;
+    NEXT();
+    DISPATCH();
+
+  TARGET(MEMCPY)
+    // d s n
+    NEED(3);
+
+    if ( !copy_cells(sp[-2], sp[-1], tos) )
+      FAULT("MEMCPY");
+
+    if ( STATS ) {
+      st->load(slot(sp[-1]), tos);
+      st->store(slot(sp[-2]), tos);
+    }
+
+    sp -= 3;
+    tos = *sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(MEMSET)
+    // d v n
+    NEED(3);
+
+    if ( !fill_cells(sp[-2], sp[-1], tos) )
+      FAULT("MEMSET");
+
+    if ( STATS )
+      st->store(slot(sp[-2]), tos);
+
+    sp -= 3;
+    tos = *sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(MEMCMP)
+    // a b n
+    NEED(3);
+
+    if ( !compare_cells(sp[-2], sp[-1], tos, b) )
+      FAULT("MEMCMP");
+
+    if ( STATS ) {
+      st->load(slot(sp[-2]), tos);
+      st->load(slot(sp[-1]), tos);
+    }
+
+    sp -= 2;
+    tos = b;
+    NEXT();
+    DISPATCH();
+
+  TARGET(MEMCHR)
+    // a v n
+    NEED(3);
+
+    if ( !find_cell(sp[-2], sp[-1], tos, b) )
+      FAULT("MEMCHR");
+
+    if ( STATS )
+      st->load(slot(sp[-2]), b == -1 ? tos : (b - sp[-2])/W + 1);
+
+    sp -= 2;
+    tos = b;
+    NEXT();
+    DISPATCH();
+
+  TARGET(IN)
+    flush_output();
+    b = getc(fin);
+
+    if ( b == EOF && would_block(fin) )
+      WAIT();
+
+    PUSHD(b);
+    NEXT();
+    DISPATCH();
+
+  TARGET(OUT)
+    NEED(1);
+    put(tos);
+    tos = *--sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(OUTNUM)
+    NEED(1);
+    put_number(tos);
+    tos = *--sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(READ)
+    NEED(2);
+
+    if ( !check_range(sp[-1], tos, a) )
+      FAULT("READ");
+
+    b = read_cells(a, tos);
+
+    if ( would_block(fin) && b == 0 )
+      WAIT();
+
+    tos = b;
+
+    if ( STATS )
+      st->store(a, tos);
+
+    --sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(WRITE)
+    NEED(2);
+
+    if ( !check_range(sp[-1], tos, a) )
+      FAULT("WRITE");
+
+    tos = write_cells(a, tos);
+
+    if ( STATS )
+      st->load(a, tos);
+
+    --sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(LOAD)
+    NEED(1);
+    BOUNDS(tos, "LOAD");
+    tos = mem[a];
+
+    if ( STATS )
+      st->load(a);
+
+    NEXT();
+    DISPATCH();
+
+  TARGET(STOR)
+    NEED(2);
+    BOUNDS(tos, "STOR");
+    mem[a] = sp[-1];
+
+    if ( STATS )
+      st->store(a);
+
+    sp -= 2;
+    tos = *sp;
+    invalidate(a);
+    NEXT();
+    DISPATCH();
+
+  TARGET(JMP)
+    NEED(1);
+    BOUNDS(tos, "JMP");
+    tos = *--sp;
+
+    // jumping to the current address means halt
+    if ( a == pc ) {
+      running = false;
+      status = STATUS_HALTED;
+      goto out;
+    }
+
+    pc = a;
+    BRANCH();
+
+  TARGET(JZ)
+    NEED(2);
+    b = sp[-1];
+    a = tos;
+    sp -= 2;
+    tos = *sp;
+
+    if ( a != 0 ) {
+      NEXT();
+      DISPATCH();
+    }
+
+    BOUNDS(b, "JZ");
+    pc = a;
+    BRANCH();
+
+  TARGET(JNZ)
+    NEED(2);
+    b = sp[-1];
+    a = tos;
+    sp -= 2;
+    tos = *sp;
+
+    if ( a == 0 ) {
+      NEXT();
+      DISPATCH();
+    }
+
+    BOUNDS(b, "JNZ");
+    pc = a;
+    BRANCH();
+
+  TARGET(PUSH)
+    PUSHD(cache[pc].imm);
+    SKIP(2);
+    DISPATCH();
+
+  TARGET(DROP)
+    NEED(1);
+    tos = *--sp;
+    NEXT();
+    DISPATCH();
+
+  TARGET(PUSHIP)
+    if ( rp == rlim && !GROWIP() )
+      FAULT("IP stack overflow");
+
+    *rp++ = cache[pc].imm;
+
+    if ( PROFILING )
+      prof->call(cache[pc].imm);
+
+    SKIP(2);
+    DISPATCH();
+
+  TARGET(POPIP)
+    if ( rp == rbase )
+      FAULT("POP empty IP stack");
+
+    BOUNDS(*--rp, "POPIP");
+
+    if ( PROFILING )
+      prof->ret();
+
+    pc = a;
+    BRANCH();
+
+  TARGET(DROPIP)
+    if ( rp == rbase )
+      FAULT("POP empty IP stack");
+
+    --rp;
+
+    if ( PROFILING )
+      prof->ret();
+
+    NEXT();
+    DISPATCH();
+
+  TARGET(DUP)
+    NEED(1);
+    ROOM();
+    *sp++ = tos;
+    NEXT();
+    DISPATCH();
+
+  TARGET(SWAP)
+    NEED(2);
+    b = sp[-1];
+    sp[-1] = tos;
+    tos = b;
+    NEXT();
+    DISPATCH();
+
+  TARGET(ROL3)
+    // abc -> bca
+    NEED(3);
+    b = sp[-2];
+    sp[-2] = sp[-1];
+    sp[-1] = tos;
+    tos = b;
+    NEXT();
+    DISPATCH();
+
+  // fused instructions, see decode()
+
+  TARGET(CALL)
+    if ( rp == rlim && !GROWIP() )
+      FAULT("IP stack overflow");
+
+    *rp++ = (pc + 5)*sizeof(word_t);
+    PROFILE(pc + 2);
+    PROFILE(pc + 4);
+
+    if ( PROFILING )
+      prof->call((pc + 5)*sizeof(word_t));
+
+    pc = cache[pc].imm;
+    RETIRE(2);
+    BRANCH();
+
+  TARGET(JMPI)
+    PROFILE(pc + 2);
+    pc = cache[pc].imm;
+    RETIRE(1);
+    BRANCH();
+
+  TARGET(HALT)
+    pc += 2;
+    PROFILE(pc);
+    running = false;
+    RETIRE(1);
+    goto out;
+
+  TARGET(ADDI)
+    NEED(1);
+    tos += cache[pc].imm;
+    RETIRE(1);
+    PROFILE(pc + 2);
+    SKIP(3);
+    DISPATCH();
+
+  TARGET(LOADA)
+    PUSHD(mem[cache[pc].imm]);
+
+    if ( STATS )
+      st->load(cache[pc].imm);
+    RETIRE(1);
+    PROFILE(pc + 2);
+    SKIP(3);
+    DISPATCH();
+
+  TARGET(STORA)
+    NEED(1);
+    a = cache[pc].imm;
+    mem[a] = tos;
+
+    if ( STATS )
+      st->store(a);
+
+    tos = *--sp;
+    invalidate(a);
+    RETIRE(1);
+    PROFILE(pc + 2);
+    SKIP(3);
+    DISPATCH();
+
+#ifndef THREADED_CODE
+  }
+#endif
+
+enter_native:
+  {
+    jit_block_t *blk = native->lookup(pc);
+
+    if ( blk == NULL )
+      blk = native->hit(pc, native_words(mem));
+
+    while ( blk != NULL && scap - (sp - sbase) < blk->grow && GROW() )
+      ;
+
+    // native code keeps the whole stack in memory
+    if ( blk == NULL || sp - sbase < blk->need
+                     || scap - (sp - sbase) < blk->grow )
+      DISPATCH();
+
+    *sp = tos;
+    js.sp = native_words(sp + 1);
+    js.sbase = native_words(sbase + 1);
+    js.slimit = native_words(sbase + 1 + scap);
+    if ( BUDGETED )
+      js.limit = budget - count;
+
+    pc = blk->fn(&js);
+    sp = reinterpret_cast<word_t*>(js.sp) - 1;
+    tos = *sp;
+
+    // so that the interpreter sees the budget spent by native code
+    count += js.retired;
+    js.retired = 0;
+
+    if ( SPENT() ) {
+      pc &= ~JIT_INTERPRET;
+      goto pause;
+    }
+
+    if ( pc & JIT_INTERPRET ) {
+      pc &= ~JIT_INTERPRET;
+      DISPATCH();
+    }
+
+    goto enter_native;
+  }
+
+pause:
+  status = STATUS_EXHAUSTED;
+
+out:
+  flush_output();
+  ip = pc*sizeof(word_t);
+  *sp = tos;
+  stack_depth = sp - sbase;
+  stackip_depth = rp - rbase;
+
+  if ( COUNTING && counting )
+    retired += count;
+
+  if ( STATS ) {
+    // the last instruction may have grown a stack
+    depth = std::max(depth, sp - sbase);
+    ipdepth = std::max(ipdepth, rp - rbase);
+    st->max_stack = std::max(st->max_stack, static_cast<size_t>(depth));
+    st->max_stackip = std::max(st->max_stackip,
+                               static_cast<size_t>(ipdepth));
+    tally(handlers, st->ops);
+  }
+
+  return status;
+
+#undef SPENT
+#undef NEXT
+#undef SKIP
+#undef FAULT
+#undef BOUNDS
+#undef NEED
+#undef GROW
+#undef GROWIP
+#undef ROOM
+#undef PUSHD
+#undef BRANCH
+#undef RETIRE
+#undef PROFILE
+#undef TALLY
+#undef UNCOUNT
+#undef WAIT
+#undef TARGET
+#undef DISPATCH
+}
+
+static double seconds()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+// Runs with the instantiation of execute() for the current settings, and
+// a budget of instructions unless it is zero
+template<typename word_t>
+run_status_t basic_machine_t<word_t>::resume(int32_t start_address,
+                                              uint64_t budget)
+{
+  typedef run_status_t (basic_machine_t::*execute_fn)(int32_t, uint64_t);
+
+  // a budget needs the instructions counted anyway
+  static const execute_fn modes[] = {
+    &basic_machine_t::execute<0>,
+    &basic_machine_t::execute<RUN_COUNT>,
+    &basic_machine_t::execute<RUN_PROFILE>,
+    &basic_machine_t::execute<RUN_COUNT | RUN_PROFILE>,
+    &basic_machine_t::execute<RUN_STATS>,
+    &basic_machine_t::execute<RUN_COUNT | RUN_STATS>,
+    &basic_machine_t::execute<RUN_PROFILE | RUN_STATS>,
+    &basic_machine_t::execute<RUN_COUNT | RUN_PROFILE | RUN_STATS>,
+    &basic_machine_t::execute<RUN_BUDGET>,
+    &basic_machine_t::execute<RUN_BUDGET>,
+    &basic_machine_t::execute<RUN_BUDGET | RUN_PROFILE>,
+    &basic_machine_t::execute<RUN_BUDGET | RUN_PROFILE>,
+    &basic_machine_t::execute<RUN_BUDGET | RUN_STATS>,
+    &basic_machine_t::execute<RUN_BUDGET | RUN_STATS>,
+    &basic_machine_t::execute<RUN_BUDGET | RUN_PROFILE | RUN_STATS>,
+    &basic_machine_t::execute<RUN_BUDGET | RUN_PROFILE | RUN_STATS>
+  };
+
+  const int mode = (counting ? RUN_COUNT : 0)
+                 | (profile ? RUN_PROFILE : 0)
+                 | (stats ? RUN_STATS : 0)
+                 | (budget ? RUN_BUDGET : 0);
+
+  if ( stats == NULL )
+    return (this->*modes[mode])(start_address, budget);
+
+  const double start = seconds();
+  const run_status_t r = (this->*modes[mode])(start_address, budget);
+  stats->seconds += seconds() - start;
+  return r;
+}
+
+template<typename word_t>
+int basic_machine_t<word_t>::run(int32_t start_address)
+{
+  resume(start_address, 0);
+  return 0;
+}
+
+// Makes the next run_for() start at an address
+template<typename word_t>
+void basic_machine_t<word_t>::start(int32_t start_address)
+{
+  ip = start_address;
+  running = true;
+}
+
+/*
+ * Runs from pos() for about max_steps instructions, and returns why it
+ * stopped.  The budget is only checked at jumps, so it may be overrun by
+ * the length of a basic block.  If fin is non-blocking, IN and READ return
+ * STATUS_WAITING instead of blocking, and are retried when resumed.
+ *
+ * Calling it again continues where it stopped, as if it never had.
+ */
+template<typename word_t>
+run_status_t basic_machine_t<word_t>::run_for(uint64_t max_steps)
+{
+  if ( !running )
+    return STATUS_HALTED;
+
+  if ( max_steps == 0 )
+    return STATUS_EXHAUSTED;
+
+  return resume(ip, max_steps);
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::instr_nop()
+{
+  next();
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::instr_add()
+{
+  push(pop() + pop());
+  next();
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::instr_sub()
+{
+  /*
+   * This operation is not primitive.  It can
+   * be implemented by adding the minuend to
+   * the two's complement of the subtrahend:
+   *
+   * SUB: ; ( a b -- (b-a))
+   *   swap  ; b a
+   *   compl ; b ~a
+   *   1 add ; b (~a+1), or b -a
+   *   add   ; b-a
+   *   popip
+   *
+   * The problem is that IF the underlying
+   * architecture does not use two's complement
+   * to represent negative values, stuff like
+   * printing will fail miserably (at least in
+   * the current implementation on top of C).
+   */
+
+  // TODO: Consider reversing the operands for SUB
+  //       (it's currently unnatural)
+
+  word_t tos = pop();
+  push(tos - pop());
+  next();
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::instr_and()
+{
+  push(pop() & pop());
+  next();
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::instr_or()
+{
+  push(pop() | pop());
+  next();
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::instr_xor()
 {
-  delete[](memory);
+  push(pop() ^ pop());
+  next();
 }
 
-void machine_t::error(const char* s) const
+template<typename word_t>
+void basic_machine_t<word_t>::instr_not()
 {
-  if ( error_cb )
-    error_cb(s);
+  // TODO: this probably does not work as intended
+  push(!pop());
+  next();
 }
 
-void machine_t::push(const int32_t& n)
+template<typename word_t>
+void basic_machine_t<word_t>::instr_compl()
 {
-  stack.push_back(n);
+  push(~pop());
+  next();
 }
 
-void machine_t::puship(const int32_t& n)
+template<typename word_t>
+void basic_machine_t<word_t>::instr_mul()
 {
-  stackip.push_back(n);
+  word_t a = pop();
+  push(op_mul(pop(), a));
+  next();
 }
 
-int32_t machine_t::popip()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_div()
 {
-  if ( stackip.empty() ) {
-    error("POP empty IP stack");
-    return 0;
+  word_t a = pop();
+  word_t b = pop();
+
+  if ( a == 0 ) {
+    error("Division by zero");
+    return;
   }
 
-  int32_t n = stackip.back();
-  stackip.pop_back();
-  return n;
+  push(op_div(b, a));
+  next();
 }
 
-int32_t machine_t::pop()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_mod()
 {
-  if ( stack.empty() )
-    error("POP empty stack");
+  word_t a = pop();
+  word_t b = pop();
 
-  int32_t n = stack.back();
-  stack.pop_back();
-  return n;
+  if ( a == 0 ) {
+    error("Division by zero");
+    return;
+  }
+
+  push(op_mod(b, a));
+  next();
 }
 
-void machine_t::check_bounds(int32_t n, const char* msg) const
+template<typename word_t>
+void basic_machine_t<word_t>::instr_shl()
 {
-  if ( n < 0 || static_cast<size_t>(n) >= memsize )
-    error(msg);
+  word_t a = pop();
+  push(op_shl(pop(), a));
+  next();
 }
 
-void machine_t::next()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_shr()
 {
-  ip += sizeof(int32_t);
+  word_t a = pop();
+  push(op_shr(pop(), a));
+  next();
+}
 
-  if ( ip < 0 )
-    error("IP < 0");
+template<typename word_t>
+void basic_machine_t<word_t>::instr_sar()
+{
+  word_t a = pop();
+  push(op_sar(pop(), a));
+  next();
+}
 
-  if ( static_cast<size_t>(ip) >= memsize )
-    ip = 0; // TODO: Halt instead of wrap-around?
+template<typename word_t>
+void basic_machine_t<word_t>::instr_lt()
+{
+  word_t a = pop();
+  push(pop() < a);
+  next();
 }
 
-void machine_t::prev()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_gt()
 {
-  if ( ip == 0 )
-    error("prev() reached zero");
+  word_t a = pop();
+  push(pop() > a);
+  next();
+}
 
-  ip -= sizeof(int32_t);
+template<typename word_t>
+void basic_machine_t<word_t>::instr_eq()
+{
+  word_t a = pop();
+  push(pop() == a);
+  next();
 }
 
-void machine_t::load(Op op)
+template<typename word_t>
+void basic_machine_t<word_t>::instr_vector(Op op)
 {
-  memory[ip] = op;
+  word_t len = pop();
+  word_t b = pop();
+  word_t a = pop();
+  word_t dst = pop();
+
+  if ( !vector(op, dst, a, b, len) ) {
+    error(to_s(op));
+    return;
+  }
+
   next();
 }
 
-void machine_t::load(int32_t n)
+template<typename word_t>
+void basic_machine_t<word_t>::instr_reduce(Op op)
 {
-  memory[ip] = n;
+  word_t len = pop();
+  word_t a = pop();
+  word_t r;
+
+  if ( !reduce(op, a, len, r) ) {
+    error(to_s(op));
+    return;
+  }
+
+  push(r);
   next();
 }
 
-int machine_t::run(int32_t start_address)
+template<typename word_t>
+void basic_machine_t<word_t>::instr_vadd()
 {
-  ip = start_address;
+  instr_vector(VADD);
+}
 
-  while(running)
-    exec(static_cast<Op>(memory[ip]));
+template<typename word_t>
+void basic_machine_t<word_t>::instr_vsub()
+{
+  instr_vector(VSUB);
+}
 
-  return 0; // TODO: exit-code ?
+template<typename word_t>
+void basic_machine_t<word_t>::instr_vand()
+{
+  instr_vector(VAND);
 }
 
-void machine_t::instr_nop()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_vor()
 {
-  next();
+  instr_vector(VOR);
 }
 
-void machine_t::instr_add()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_vxor()
 {
-  push(pop() + pop());
-  next();
+  instr_vector(VXOR);
 }
 
-void machine_t::instr_sub()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_vsum()
 {
-  /*
-   * This operation is not primitive.  It can
-   * be implemented by adding the minuend to
-   * the two's complement of the subtrahend:
-   *
-   * SUB: ; ( a b -- (b-a))
-   *   swap  ; b a
-   *   compl ; b ~a
-   *   1 add ; b (~a+1), or b -a
-   *   add   ; b-a
-   *   popip
-   *
-   * The problem is that IF the underlying
-   * architecture does not use two's complement
-   * to represent negative values, stuff like
-   * printing will fail miserably (at least in
-   * the current implementation on top of C).
-   */
+  instr_reduce(VSUM);
+}
 
-  // TODO: Consider reversing the operands for SUB
-  //       (it's currently unnatural)
+template<typename word_t>
+void basic_machine_t<word_t>::instr_vmin()
+{
+  instr_reduce(VMIN);
+}
 
-  int32_t tos = pop();
-  push(tos - pop());
-  next();
+template<typename word_t>
+void basic_machine_t<word_t>::instr_vmax()
+{
+  instr_reduce(VMAX);
 }
 
-void machine_t::instr_and()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_vdot()
 {
-  push(pop() & pop());
+  word_t len = pop();
+  word_t b = pop();
+  word_t a = pop();
+  word_t r;
+
+  if ( !dot(a, b, len, r) ) {
+    error("VDOT");
+    return;
+  }
+
+  push(r);
   next();
 }
 
-void machine_t::instr_or()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_memcpy()
 {
-  push(pop() | pop());
+  word_t len = pop();
+  word_t src = pop();
+  word_t dst = pop();
+
+  if ( !copy_cells(dst, src, len) ) {
+    error("MEMCPY");
+    return;
+  }
+
   next();
 }
 
-void machine_t::instr_xor()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_memset()
 {
-  push(pop() ^ pop());
+  word_t len = pop();
+  word_t value = pop();
+  word_t dst = pop();
+
+  if ( !fill_cells(dst, value, len) ) {
+    error("MEMSET");
+    return;
+  }
+
   next();
 }
 
-void machine_t::instr_not()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_memcmp()
 {
-  // TODO: this probably does not work as intended
-  push(!pop());
+  word_t len = pop();
+  word_t b = pop();
+  word_t a = pop();
+  word_t r;
+
+  if ( !compare_cells(a, b, len, r) ) {
+    error("MEMCMP");
+    return;
+  }
+
+  push(r);
   next();
 }
 
-void machine_t::instr_compl()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_memchr()
 {
-  push(~pop());
+  word_t len = pop();
+  word_t value = pop();
+  word_t a = pop();
+  word_t r;
+
+  if ( !find_cell(a, value, len, r) ) {
+    error("MEMCHR");
+    return;
+  }
+
+  push(r);
   next();
 }
 
-void machine_t::instr_in()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_in()
 {
   /*
    * The IN/OUT functions should be implemented
@@ -265,40 +2117,83 @@ void machine_t::instr_in()
    * 123 SYSCALL ; exec system call 123
    *
    */
+  flush_output();
   push(getc(fin));
   next();
 }
 
-void machine_t::instr_out()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_out()
 {
-  putc(pop(), fout);
-  fflush(fout);
+  output();
+  put(pop());
+  next();
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::instr_outnum()
+{
+  output();
+  put_number(pop());
+  next();
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::instr_read()
+{
+  word_t len = pop();
+  word_t adr = pop();
+  uword_t first;
+
+  if ( !check_range(adr, len, first) ) {
+    error("READ");
+    return;
+  }
+
+  push(read_cells(first, len));
   next();
 }
 
-void machine_t::instr_outnum()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_write()
 {
-  fprintf(fout, "%u", pop());
+  word_t len = pop();
+  word_t adr = pop();
+  uword_t first;
+
+  if ( !check_range(adr, len, first) ) {
+    error("WRITE");
+    return;
+  }
+
+  push(write_cells(first, len));
   next();
 }
 
-void machine_t::instr_load()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_load()
 {
-  int32_t a = pop();
+  word_t a = pop();
   check_bounds(a, "LOAD");
-  push(memory[a]);
+  push(memory[slot(a)]);
   next();
 }
 
-void machine_t::instr_stor()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_stor()
 {
-  int32_t a = pop();
+  word_t a = pop();
   check_bounds(a, "STOR");
-  memory[a] = pop();
+  memory[slot(a)] = pop();
+
+  if ( code )
+    invalidate(slot(a));
+
   next();
 }
 
-void machine_t::instr_jmp()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_jmp()
 {
   /*
    * This function is not primitive.
@@ -315,21 +2210,23 @@ void machine_t::instr_jmp()
   //push(0);
   //instr_jz();
 
-  int32_t a = pop();
+  word_t a = pop();
   check_bounds(a, "JMP");  
 
   // check if we are halting, i.e. jumping to current
   // address -- if so, quit
-  if ( a == ip )
+  if ( a == ip ) {
     running = false;
-  else
+    flush_output();
+  } else
     ip = a;
 }
 
-void machine_t::instr_jz()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_jz()
 {
-  int32_t a = pop();
-  int32_t b = pop();
+  word_t a = pop();
+  word_t b = pop();
 
   if ( a != 0 )
     next();
@@ -339,26 +2236,30 @@ void machine_t::instr_jz()
   }
 }
 
-void machine_t::instr_drop()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_drop()
 {
   pop();
   next();
 }
 
-void machine_t::instr_popip()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_popip()
 {
-  int32_t a = popip();
+  word_t a = popip();
   check_bounds(a, "POPIP");
   ip = a;
 }
 
-void machine_t::instr_dropip()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_dropip()
 {
   popip();
   next();
 }
 
-void machine_t::instr_jnz()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_jnz()
 {
   /*
    * Only one of JNZ and JZ is needed as
@@ -376,8 +2277,8 @@ void machine_t::instr_jnz()
   instr_jz();
   */
 
-  int32_t a = pop();
-  int32_t b = pop();
+  word_t a = pop();
+  word_t b = pop();
 
   if ( a == 0 )
     next();
@@ -387,21 +2288,24 @@ void machine_t::instr_jnz()
   }
 }
 
-void machine_t::instr_push()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_push()
 {
   next();
-  push(memory[ip]);
+  push(memory[slot(ip)]);
   next();
 }
 
-void machine_t::instr_puship()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_puship()
 {
   next();
-  puship(memory[ip]);
+  puship(memory[slot(ip)]);
   next();
 }
 
-void machine_t::instr_dup()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_dup()
 {
   /*
    * This function is not primitive.
@@ -417,13 +2321,14 @@ void machine_t::instr_dup()
 
   // TODO: Implement as library function
 
-  int32_t a = pop();
+  word_t a = pop();
   push(a);
   push(a);
   next();
 }
 
-void machine_t::instr_swap()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_swap()
 {
   /*
    * This function is not primitive.
@@ -445,14 +2350,15 @@ void machine_t::instr_swap()
   // TODO: Implement as library function
 
   // a, b -- b, a
-  int32_t b = pop();
-  int32_t a = pop();
+  word_t b = pop();
+  word_t a = pop();
   push(b);
   push(a);
   next();
 }
 
-void machine_t::instr_rol3()
+template<typename word_t>
+void basic_machine_t<word_t>::instr_rol3()
 {
   /*
    * This function is not primitive.
@@ -472,16 +2378,17 @@ void machine_t::instr_rol3()
   // TODO: Implement as library function
 
   // abc -> bca
-  int32_t c = pop(); // TOS
-  int32_t b = pop();
-  int32_t a = pop();
+  word_t c = pop(); // TOS
+  word_t b = pop();
+  word_t a = pop();
   push(b);
   push(c);
   push(a);
   next();
 }
 
-void machine_t::exec(Op operation)
+template<typename word_t>
+void basic_machine_t<word_t>::exec(Op operation)
 {
   switch(operation) {
   default:     error("Unknown instruction"); break;
@@ -505,6 +2412,38 @@ void machine_t::exec(Op operation)
   case NOT:    instr_not();    break;
   case COMPL:  instr_compl();  break;
 
+  // All of these can be built from the above with loops,
+  // but far too slowly
+
+  case MUL:    instr_mul();    break; // non-primitive
+  case DIV:    instr_div();    break; // non-primitive
+  case MOD:    instr_mod();    break; // non-primitive
+  case SHL:    instr_shl();    break; // non-primitive
+  case SHR:    instr_shr();    break; // non-primitive
+  case SAR:    instr_sar();    break; // non-primitive
+  case LT:     instr_lt();     break; // non-primitive
+  case GT:     instr_gt();     break; // non-primitive
+  case EQ:     instr_eq();     break; // non-primitive
+
+  // Loops over ranges of memory, run on SIMD kernels
+
+  case VADD:   instr_vadd();   break; // non-primitive
+  case VSUB:   instr_vsub();   break; // non-primitive
+  case VAND:   instr_vand();   break; // non-primitive
+  case VOR:    instr_vor();    break; // non-primitive
+  case VXOR:   instr_vxor();   break; // non-primitive
+  case VSUM:   instr_vsum();   break; // non-primitive
+  case VMIN:   instr_vmin();   break; // non-primitive
+  case VMAX:   instr_vmax();   break; // non-primitive
+  case VDOT:   instr_vdot();   break; // non-primitive
+
+  // Loops over ranges of memory, run on the C library
+
+  case MEMCPY: instr_memcpy(); break; // non-primitive
+  case MEMSET: instr_memset(); break; // non-primitive
+  case MEMCMP: instr_memcmp(); break; // non-primitive
+  case MEMCHR: instr_memchr(); break; // non-primitive
+
   // Should be replaced with x86 INT-like operations
 
   case IN:     instr_in();     break;
@@ -527,119 +2466,501 @@ void machine_t::exec(Op operation)
   case SWAP:   instr_swap();   break; // non-primitive 
   case ROL3:   instr_rol3();   break; // non-primitive
   case OUTNUM: instr_outnum(); break; // non-primitive
+  case READ:   instr_read();   break; // non-primitive
+  case WRITE:  instr_write();  break; // non-primitive
   }
 }
 
-int32_t* machine_t::find_end() const
+template<typename word_t>
+word_t* basic_machine_t<word_t>::find_end() const
 {
   // find end of program by scanning
   // backwards until non-NOP is found
-  int32_t *p = &memory[memsize-1];
-  while ( *p == NOP ) --p;
+  word_t *p = &memory[memsize];
+  while ( p != memory && p[-1] == NOP ) --p;
   return p;
 }
 
-void machine_t::load_image(FILE* f)
+template<typename word_t>
+void basic_machine_t<word_t>::load_image(FILE* f)
 {
+  const bool wide = sizeof(word_t) == sizeof(int64_t);
+  char magic[sizeof(IMAGE64_MAGIC)];
+
   reset();
 
-  while ( !feof(f) ) {
-    Op op = NOP;
-    fread(&op, sizeof(Op), 1, f);
-    load(op);
+  if ( wide && (fread(magic, 1, sizeof(magic), f) != sizeof(magic)
+                || memcmp(magic, IMAGE64_MAGIC, sizeof(magic)) != 0) )
+  {
+    error("Image does not have 64-bit words");
+    return;
   }
 
+  // the rest of the image is a plain copy of the memory words
+  size_t words = fread(memory, sizeof(word_t), memsize, f);
+
+  if ( !feof(f) && fgetc(f) != EOF )
+    error("Image does not fit in memory");
+
+  if ( !wide && words >= sizeof(magic)/sizeof(word_t)
+             && memcmp(memory, IMAGE64_MAGIC, sizeof(magic)) == 0 )
+    error("Image has 64-bit words");
+
   ip = 0;
 }
 
-void machine_t::save_image(FILE* f) const
+template<typename word_t>
+void basic_machine_t<word_t>::save_image(FILE* f) const
 {
-  int32_t *start = memory;
-  int32_t *end = find_end() + sizeof(int32_t);
+  if ( sizeof(word_t) == sizeof(int64_t) )
+    fwrite(IMAGE64_MAGIC, 1, sizeof(IMAGE64_MAGIC), f);
 
-  while ( start != end ) {
-    fwrite(start, sizeof(Op), 1, f);
-    start += sizeof(int32_t);
-  }
+  fwrite(memory, sizeof(word_t), find_end() - memory, f);
 }
 
-void machine_t::load_halt()
+template<typename word_t>
+void basic_machine_t<word_t>::load_halt()
 {
   load(PUSH);
-  load(ip + sizeof(int32_t));
+  load(ip + sizeof(word_t));
   load(JMP);
 }
 
-size_t machine_t::size() const
+template<typename word_t>
+size_t basic_machine_t<word_t>::size() const
 {
-  return find_end() - &memory[0];
+  return (find_end() - memory)*sizeof(word_t);
 }
 
-int32_t machine_t::cur() const
+template<typename word_t>
+word_t basic_machine_t<word_t>::cur() const
 {
-  return memory[ip];
+  return memory[slot(ip)];
 }
 
-int32_t machine_t::pos() const
+template<typename word_t>
+int32_t basic_machine_t<word_t>::pos() const
 {
   return ip;
 }
 
-void machine_t::addlabel(const char* name, int32_t pos, int)
+template<typename word_t>
+void basic_machine_t<word_t>::addlabel(std::string_view name, int32_t pos, int)
 {
-  std::string n = upper(name);
-
-  if ( n.empty() )
+  if ( name.empty() )
     error("Empty label");
-  else {
-    n.erase(n.length()-1, 1); // remove ":"
-    labels.push_back(label_t(n.c_str(), pos));
-  }
+  else if ( !labels.add(name.data(), name.length()-1, pos) ) // without ":"
+    error(("Duplicate label: " +
+           std::string(name.substr(0, name.length()-1))).c_str());
 }
 
-int32_t machine_t::get_label_address(const std::string& s) const
+template<typename word_t>
+int32_t basic_machine_t<word_t>::get_label_address(std::string_view s) const
 {
-  std::string p(upper(s));
-
   // special label address "here" returns current position
-  if ( p == "HERE" )
+  if ( s.length() == 4 && !strncasecmp(s.data(), "HERE", 4) )
     return ip;
 
-  for ( size_t n=0; n < labels.size(); ++n )
-    if ( upper(labels[n].name.c_str()) == p )
-      return labels[n].pos;
-  
-  return -1; // not found
+  return labels.find(s.data(), s.length());
 }
 
-bool machine_t::isrunning() const
+template<typename word_t>
+bool basic_machine_t<word_t>::isrunning() const
 {
   return running;
 }
 
-void machine_t::set_fout(FILE* f)
+/*
+ * Checks that the `len` cells from address `adr` are in memory, and sets
+ * `first` to the slot of the first one.
+ */
+template<typename word_t>
+bool basic_machine_t<word_t>::check_range(word_t adr, word_t len,
+                                          uword_t& first) const
+{
+  first = slot(adr);
+  return len >= 0 && (len == 0 || first < memsize)
+                  && static_cast<size_t>(len) <= memsize - first;
+}
+
+// True if two ranges of `count` cells overlap, but are not the same
+static bool overlaps(uint32_t a, uint32_t b, size_t count)
+{
+  return a != b && a < b + count && b < a + count;
+}
+
+/*
+ * The vector instructions.  Each checks its ranges once, and then runs
+ * the kernel from vecops() over all of them.  Element-wise operations
+ * read both sources in full before writing, also where they overlap the
+ * destination.
+ */
+template<typename word_t>
+bool basic_machine_t<word_t>::vector(Op op, word_t dst, word_t a, word_t b,
+                                     word_t len)
+{
+  uword_t d, x, y;
+
+  if ( !check_range(dst, len, d) || !check_range(a, len, x)
+       || !check_range(b, len, y) )
+    return false;
+
+  if ( len == 0 )
+    return true;
+
+  const word_t *p = memory + x;
+  const word_t *q = memory + y;
+  std::vector<word_t> pcopy, qcopy;
+
+  if ( overlaps(d, x, len) ) {
+    pcopy.assign(p, p + len);
+    p = &pcopy[0];
+  }
+
+  if ( overlaps(d, y, len) ) {
+    qcopy.assign(q, q + len);
+    q = &qcopy[0];
+  }
+
+  vecops<word_t>().binary[op - VADD](memory + d, p, q, len);
+
+  if ( code )
+    invalidate(d, len);
+
+  return true;
+}
+
+template<typename word_t>
+bool basic_machine_t<word_t>::reduce(Op op, word_t a, word_t len,
+                                     word_t& result) const
+{
+  uword_t x;
+
+  if ( !check_range(a, len, x) )
+    return false;
+
+  result = vecops<word_t>().reduce[op - VSUM](memory + x, len);
+  return true;
+}
+
+template<typename word_t>
+bool basic_machine_t<word_t>::dot(word_t a, word_t b, word_t len,
+                                  word_t& result) const
+{
+  uword_t x, y;
+
+  if ( !check_range(a, len, x) || !check_range(b, len, y) )
+    return false;
+
+  result = vecops<word_t>().dot(memory + x, memory + y, len);
+  return true;
+}
+
+/*
+ * The bulk memory instructions.  Each checks its ranges once, and then
+ * runs on the C library.  Cells are compared and searched for as whole
+ * signed words, with the wide character functions where wchar_t is one.
+ */
+template<typename word_t>
+struct wchar_is_word {
+  static const bool value =
+    sizeof(wchar_t) == sizeof(word_t) && static_cast<wchar_t>(-1) < 0;
+};
+
+template<typename word_t>
+bool basic_machine_t<word_t>::copy_cells(word_t dst, word_t src, word_t len)
+{
+  uword_t d, s;
+
+  if ( !check_range(dst, len, d) || !check_range(src, len, s) )
+    return false;
+
+  if ( len == 0 )
+    return true;
+
+  // the ranges may overlap
+  memmove(memory + d, memory + s, len*sizeof(word_t));
+
+  if ( code )
+    invalidate(d, len);
+
+  return true;
+}
+
+template<typename word_t>
+bool basic_machine_t<word_t>::fill_cells(word_t dst, word_t value, word_t len)
+{
+  uword_t d;
+
+  if ( !check_range(dst, len, d) )
+    return false;
+
+  if ( len == 0 )
+    return true;
+
+  if ( value == 0 || value == -1 )
+    memset(memory + d, value, len*sizeof(word_t));
+  else if ( wchar_is_word<word_t>::value )
+    wmemset(reinterpret_cast<wchar_t*>(memory + d), value, len);
+  else
+    std::fill(memory + d, memory + d + len, value);
+
+  if ( code )
+    invalidate(d, len);
+
+  return true;
+}
+
+template<typename word_t>
+bool basic_machine_t<word_t>::compare_cells(word_t a, word_t b, word_t len,
+                                            word_t& result) const
+{
+  uword_t x, y;
+
+  if ( !check_range(a, len, x) || !check_range(b, len, y) )
+    return false;
+
+  const word_t *p = memory + x;
+  const word_t *q = memory + y;
+  int r = 0;
+
+  if ( len == 0 )
+    r = 0;
+  else if ( wchar_is_word<word_t>::value )
+    r = wmemcmp(reinterpret_cast<const wchar_t*>(p),
+                reinterpret_cast<const wchar_t*>(q), len);
+  else if ( memcmp(p, q, len*sizeof(word_t)) != 0 ) {
+    std::pair<const word_t*, const word_t*> m = std::mismatch(p, p + len, q);
+    r = *m.first < *m.second ? -1 : 1;
+  }
+
+  result = (r > 0) - (r < 0);
+  return true;
+}
+
+template<typename word_t>
+bool basic_machine_t<word_t>::find_cell(word_t a, word_t value, word_t len,
+                                        word_t& result) const
+{
+  uword_t x;
+
+  if ( !check_range(a, len, x) )
+    return false;
+
+  const word_t *p = memory + x;
+  const word_t *end = p + len;
+  const word_t *at = end;
+
+  if ( len == 0 )
+    at = end;
+  else if ( wchar_is_word<word_t>::value ) {
+    const wchar_t *w = wmemchr(reinterpret_cast<const wchar_t*>(p), value, len);
+    at = w ? reinterpret_cast<const word_t*>(w) : end;
+  } else
+    at = std::find(p, end, value);
+
+  result = at == end ? -1 : a + static_cast<word_t>((at - p)*sizeof(word_t));
+  return true;
+}
+
+/*
+ * Block I/O for READ and WRITE.  Each cell holds one byte, just like with
+ * IN and OUT, and both go through the same buffers as those.
+ */
+template<typename word_t>
+size_t basic_machine_t<word_t>::read_cells(uint32_t first, size_t count)
+{
+  unsigned char buf[4096];
+  size_t done = 0;
+
+  flush_output();
+
+  while ( done < count ) {
+    size_t want = std::min(count - done, sizeof(buf));
+    size_t got = fread(buf, 1, want, fin);
+
+    for ( size_t n = 0; n < got; ++n )
+      memory[first + done + n] = buf[n];
+
+    done += got;
+
+    if ( got < want )
+      break;
+  }
+
+  if ( code )
+    invalidate(first, done);
+
+  return done;
+}
+
+template<typename word_t>
+size_t basic_machine_t<word_t>::write_cells(uint32_t first, size_t count)
+{
+  outbuf_t *ob = output();
+  bool newline = false;
+
+  for ( size_t n = 0; n < count; ++n ) {
+    char c = static_cast<char>(memory[first + n]);
+    ob->data[ob->len++] = c;
+    newline |= c == '\n';
+
+    if ( ob->len == sizeof(ob->data) )
+      flush_output();
+  }
+
+  if ( ob->len >= ob->limit || (newline && ob->lines) )
+    flush_output();
+
+  return count;
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::set_fout(FILE* f)
 {
+  flush_output();
   fout = f;
+  configure_output();
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::set_output_policy(output_policy_t policy)
+{
+  output_policy = policy;
+  configure_output();
+  flush_output();
+}
+
+// Writes out pending output
+template<typename word_t>
+void basic_machine_t<word_t>::flush()
+{
+  flush_output();
 }
 
-void machine_t::set_fin(FILE* f)
+template<typename word_t>
+void basic_machine_t<word_t>::set_fin(FILE* f)
 {
   fin = f;
 }
 
-void machine_t::set_mem(int32_t adr, int32_t val)
+template<typename word_t>
+FILE* basic_machine_t<word_t>::get_fin() const
+{
+  return fin;
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::set_error_callback(
+  void (*error_callback)(const char*))
+{
+  error_cb = error_callback;
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::set_jit_threshold(int jumps)
+{
+  jit_threshold = jumps;
+}
+
+/*
+ * Makes run() count the instructions it retires, which instructions()
+ * returns.  Running is slightly slower while this is on.
+ */
+template<typename word_t>
+void basic_machine_t<word_t>::count_instructions(bool enable)
+{
+  counting = enable;
+}
+
+template<typename word_t>
+uint64_t basic_machine_t<word_t>::instructions() const
+{
+  return retired;
+}
+
+/*
+ * In profiling mode, run() counts every instruction it executes, see
+ * profile_t.  Counts add up over runs until profiling is turned off.
+ */
+template<typename word_t>
+void basic_machine_t<word_t>::set_profiling(bool enable)
+{
+  if ( enable && profile == NULL )
+    profile = new profile_t();
+  else if ( !enable ) {
+    delete profile;
+    profile = NULL;
+  }
+}
+
+// Returns NULL unless profiling
+template<typename word_t>
+const profile_t* basic_machine_t<word_t>::get_profile() const
+{
+  return profile;
+}
+
+/*
+ * Collects resource usage in run(), see stats_t.  Like profiling, this
+ * runs without native code.  The numbers add up over runs until
+ * collecting is turned off.
+ */
+template<typename word_t>
+void basic_machine_t<word_t>::collect_stats(bool enable)
+{
+  if ( enable && stats == NULL )
+    stats = new stats_t();
+  else if ( !enable ) {
+    delete stats;
+    stats = NULL;
+  }
+}
+
+// Returns NULL unless collecting statistics
+template<typename word_t>
+const stats_t* basic_machine_t<word_t>::get_stats() const
+{
+  return stats;
+}
+
+template<typename word_t>
+void basic_machine_t<word_t>::set_mem(int32_t adr, word_t val)
 {
   check_bounds(adr, "set_mem out of bounds");
-  memory[adr] = val;
+  memory[slot(adr)] = val;
+
+  if ( code )
+    invalidate(slot(adr));
 }
 
-int32_t machine_t::get_mem(int32_t adr) const
+template<typename word_t>
+word_t basic_machine_t<word_t>::get_mem(int32_t adr) const
 {
   check_bounds(adr, "get_mem out of bounds");
-  return memory[adr];
+  return memory[slot(adr)];
+}
+
+template<typename word_t>
+int32_t basic_machine_t<word_t>::wordsize() const
+{
+  return sizeof(word_t);
 }
 
-int32_t machine_t::wordsize() const
+int image_word_bits(const char* filename)
 {
-  return sizeof(int32_t);
+  char magic[sizeof(IMAGE64_MAGIC)];
+  FILE *f = fopen(filename, "rb");
+  bool wide = f && fread(magic, 1, sizeof(magic), f) == sizeof(magic)
+                && memcmp(magic, IMAGE64_MAGIC, sizeof(magic)) == 0;
+
+  if ( f )
+    fclose(f);
+
+  return wide ? 64 : 32;
 }
+
+template class basic_snapshot_t<int32_t>;
+template class basic_snapshot_t<int64_t>;
+template class basic_machine_t<int32_t>;
+template class basic_machine_t<int64_t>;
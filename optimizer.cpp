@@ -0,0 +1,391 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdint.h>
+#include <strings.h>
+#include "optimizer.hpp"
+#include "label.hpp"
+#include "arith.hpp"
+
+// Number of labels followed to find where a jump ends up
+static const int MAX_HOPS = 16;
+
+template<typename word_t>
+static bool is_op(const std::vector<insn_t<word_t> >& c, size_t n, Op op)
+{
+  return n < c.size() && c[n].kind == INSN_OP && c[n].op == op;
+}
+
+template<typename word_t>
+static bool is_push(const std::vector<insn_t<word_t> >& c, size_t n)
+{
+  return n < c.size() && c[n].kind == INSN_PUSH;
+}
+
+static bool is_here(const std::string& name)
+{
+  return name.length() == 4 && !strncasecmp(name.c_str(), "HERE", 4);
+}
+
+static bool has(const label_table_t& t, const std::string& name)
+{
+  return t.find(name.data(), name.length()) >= 0;
+}
+
+/*
+ * The labels whose address is used for anything but jumping to them,
+ * as in "&label load" or "&label 4 add".  Jumps are "&label jmp" and
+ * "&label swap jz" or jnz.
+ */
+template<typename word_t>
+static label_table_t data_labels(const std::vector<insn_t<word_t> >& c)
+{
+  label_table_t data;
+
+  for ( size_t n=0; n < c.size(); ++n ) {
+    if ( c[n].kind != INSN_REF || is_op(c, n+1, JMP) )
+      continue;
+
+    if ( is_op(c, n+1, SWAP) && (is_op(c, n+2, JZ) || is_op(c, n+2, JNZ)) )
+      continue;
+
+    data.add(c[n].name.data(), c[n].name.length(), 0);
+  }
+
+  // labels next to each other name the same code
+  for ( size_t n=0; n < c.size(); ++n ) {
+    size_t end = n;
+    bool used = false;
+
+    while ( end < c.size() && c[end].kind == INSN_LABEL )
+      used = used || has(data, c[end++].name);
+
+    for ( size_t i=n; used && i < end; ++i )
+      data.add(c[i].name.data(), c[i].name.length(), 0);
+
+    n = end;
+  }
+
+  return data;
+}
+
+// Whether code from here on, up to the next label, must be left alone
+template<typename word_t>
+static bool freezes(const insn_t<word_t>& i, const label_table_t& data,
+                    bool frozen)
+{
+  switch ( i.kind ) {
+  case INSN_LABEL: return has(data, i.name);
+  case INSN_REF:   return frozen || is_here(i.name);
+  case INSN_OP:    return frozen || i.op == PUSH || i.op == PUSHIP;
+  default:         return frozen;
+  }
+}
+
+// Computes b op a, where a was pushed last, unless it would fail
+template<typename word_t>
+static bool fold(Op op, word_t b, word_t a, word_t& r)
+{
+  switch ( op ) {
+  case ADD: r = op_add(b, a); return true;
+  case SUB: r = op_sub(a, b); return true; // top minus the one below
+  case AND: r = b & a; return true;
+  case OR:  r = b | a; return true;
+  case XOR: r = b ^ a; return true;
+  case MUL: r = op_mul(b, a); return true;
+  case DIV: if ( a == 0 ) return false; r = op_div(b, a); return true;
+  case MOD: if ( a == 0 ) return false; r = op_mod(b, a); return true;
+  case SHL: r = op_shl(b, a); return true;
+  case SHR: r = op_shr(b, a); return true;
+  case SAR: r = op_sar(b, a); return true;
+  case LT:  r = b < a; return true;
+  case GT:  r = b > a; return true;
+  case EQ:  r = b == a; return true;
+  default:  return false;
+  }
+}
+
+// Whether "a op" leaves the number below as it is
+template<typename word_t>
+static bool is_identity(Op op, word_t a)
+{
+  switch ( op ) {
+  case ADD: case OR: case XOR: case SHL: case SHR: case SAR:
+    return a == 0;
+  case MUL: case DIV:
+    return a == 1;
+  default:
+    return false;
+  }
+}
+
+static bool is_associative(Op op)
+{
+  return op == ADD || op == AND || op == OR || op == XOR || op == MUL;
+}
+
+// Removes the last n instructions
+template<typename word_t>
+static void drop(std::vector<insn_t<word_t> >& c, size_t n)
+{
+  c.erase(c.end() - n, c.end());
+}
+
+// Rewrites the end of the code once, and returns whether it did
+template<typename word_t>
+static bool rewrite(std::vector<insn_t<word_t> >& c)
+{
+  typedef typename std::make_unsigned<word_t>::type uword_t;
+  const size_t n = c.size();
+  word_t r;
+
+  // b a op  ->  (b op a)
+  if ( n >= 3 && is_push(c, n-3) && is_push(c, n-2) && c[n-1].kind == INSN_OP
+       && fold(c[n-1].op, c[n-3].value, c[n-2].value, r) )
+  {
+    c[n-3].value = r;
+    drop(c, 2);
+    return true;
+  }
+
+  // a not  ->  !a, and a compl  ->  ~a
+  if ( n >= 2 && is_push(c, n-2) &&
+       (is_op(c, n-1, NOT) || is_op(c, n-1, COMPL)) )
+  {
+    c[n-2].value = is_op(c, n-1, NOT) ? !c[n-2].value : ~c[n-2].value;
+    drop(c, 1);
+    return true;
+  }
+
+  // b a swap  ->  a b
+  if ( n >= 3 && is_push(c, n-3) && is_push(c, n-2) && is_op(c, n-1, SWAP) ) {
+    std::swap(c[n-3].value, c[n-2].value);
+    drop(c, 1);
+    return true;
+  }
+
+  // a drop, dup drop, swap swap and compl compl do nothing
+  if ( n >= 2 && ((is_push(c, n-2) && is_op(c, n-1, DROP)) ||
+                  (is_op(c, n-2, DUP) && is_op(c, n-1, DROP)) ||
+                  (is_op(c, n-2, SWAP) && is_op(c, n-1, SWAP)) ||
+                  (is_op(c, n-2, COMPL) && is_op(c, n-1, COMPL))) )
+  {
+    drop(c, 2);
+    return true;
+  }
+
+  // 0 add, 1 mul and the like do nothing
+  if ( n >= 2 && is_push(c, n-2) && c[n-1].kind == INSN_OP
+       && is_identity(c[n-1].op, c[n-2].value) )
+  {
+    drop(c, 2);
+    return true;
+  }
+
+  // a op b op  ->  (a op b) op
+  if ( n >= 4 && is_push(c, n-4) && c[n-3].kind == INSN_OP
+       && is_associative(c[n-3].op) && is_push(c, n-2)
+       && is_op(c, n-1, c[n-3].op)
+       && fold(c[n-3].op, c[n-4].value, c[n-2].value, r) )
+  {
+    c[n-4].value = r;
+    drop(c, 2);
+    return true;
+  }
+
+  // a swap sub  ->  -a add
+  if ( n >= 3 && is_push(c, n-3) && is_op(c, n-2, SWAP) &&
+       is_op(c, n-1, SUB) )
+  {
+    c[n-3].value = op_sub<word_t>(0, c[n-3].value);
+    c[n-2].op = ADD;
+    drop(c, 1);
+    return true;
+  }
+
+  // 2^k mul  ->  k shl
+  if ( n >= 2 && is_push(c, n-2) && is_op(c, n-1, MUL) && c[n-2].value > 1 ) {
+    const uword_t a = static_cast<uword_t>(c[n-2].value);
+
+    if ( (a & (a - 1)) == 0 ) {
+      word_t k = 0;
+
+      while ( (uword_t(1) << k) != a )
+        ++k;
+
+      c[n-2].value = k;
+      c[n-1].op = SHL;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+template<typename word_t>
+static void peephole(std::vector<insn_t<word_t> >& code,
+                     const label_table_t& data)
+{
+  std::vector<insn_t<word_t> > out;
+  bool frozen = false;
+
+  out.reserve(code.size());
+
+  for ( size_t n=0; n < code.size(); ++n ) {
+    frozen = freezes(code[n], data, frozen);
+    out.push_back(code[n]);
+
+    // rewrites only match numbers and instructions, so none of them
+    // reaches back across a label
+    while ( !frozen && rewrite(out) )
+      ;
+  }
+
+  code.swap(out);
+}
+
+/*
+ * Finds the first instruction after each label, and which instructions
+ * must be left alone.
+ */
+template<typename word_t>
+static void index_code(const std::vector<insn_t<word_t> >& c,
+                       const label_table_t& data, std::vector<char>& frozen,
+                       label_table_t& at)
+{
+  bool f = false;
+
+  frozen.assign(c.size(), 0);
+
+  for ( size_t n=0; n < c.size(); ++n ) {
+    f = freezes(c[n], data, f);
+    frozen[n] = f;
+
+    if ( c[n].kind == INSN_LABEL ) {
+      size_t i = n;
+
+      while ( i < c.size() && c[i].kind == INSN_LABEL )
+        ++i;
+
+      at.add(c[n].name.data(), c[n].name.length(), i);
+    }
+  }
+}
+
+// Whether an instruction can be copied into the code of a caller
+static bool is_inlinable(Op op)
+{
+  switch ( op ) {
+  case JMP: case JZ: case JNZ: case PUSH: case PUSHIP: case POPIP:
+  case DROPIP:
+    return false;
+  default:
+    return true;
+  }
+}
+
+/*
+ * Finds the code of a function that can be inlined, from `start` up to
+ * `end`, where it returns.
+ */
+template<typename word_t>
+static bool inlinable(const std::vector<insn_t<word_t> >& c,
+                      const std::vector<char>& frozen, const label_table_t& at,
+                      const std::string& name, size_t limit,
+                      size_t& start, size_t& end)
+{
+  const int32_t i = at.find(name.data(), name.length());
+
+  if ( i < 0 || static_cast<size_t>(i) >= c.size() || frozen[i] )
+    return false;
+
+  size_t cells = 0;
+
+  for ( size_t n=i; n < c.size() && cells <= limit; ++n ) {
+    if ( is_op(c, n, POPIP) ) {
+      start = i;
+      end = n;
+      return true;
+    }
+
+    if ( c[n].kind == INSN_PUSH )
+      cells += 2;
+    else if ( c[n].kind == INSN_OP && is_inlinable(c[n].op) )
+      cells += 1;
+    else
+      return false;
+  }
+
+  return false;
+}
+
+// Replaces calls of short functions with their code
+template<typename word_t>
+static void inline_calls(std::vector<insn_t<word_t> >& c,
+                         const label_table_t& data, size_t limit)
+{
+  std::vector<insn_t<word_t> > out;
+  std::vector<char> frozen;
+  label_table_t at;
+  size_t start, end;
+
+  index_code(c, data, frozen, at);
+  out.reserve(c.size());
+
+  for ( size_t n=0; n < c.size(); ++n ) {
+    if ( c[n].kind == INSN_CALL && !frozen[n] &&
+         inlinable(c, frozen, at, c[n].name, limit, start, end) )
+      out.insert(out.end(), c.begin() + start, c.begin() + end);
+    else if ( c[n].kind != INSN_NOINLINE )
+      out.push_back(c[n]);
+  }
+
+  c.swap(out);
+}
+
+// Makes jumps and calls to code that only jumps on go to the end directly
+template<typename word_t>
+static void thread_jumps(std::vector<insn_t<word_t> >& c,
+                         const label_table_t& data)
+{
+  std::vector<char> frozen;
+  label_table_t at;
+
+  index_code(c, data, frozen, at);
+
+  for ( size_t n=0; n < c.size(); ++n ) {
+    const bool jump = c[n].kind == INSN_REF && is_op(c, n+1, JMP);
+
+    if ( frozen[n] || !(jump || c[n].kind == INSN_CALL) )
+      continue;
+
+    for ( int hops=0; hops < MAX_HOPS; ++hops ) {
+      const std::string& name = c[n].name;
+      const int32_t i = at.find(name.data(), name.length());
+
+      if ( i < 0 || static_cast<size_t>(i) >= c.size() || has(data, name) ||
+           frozen[i] || c[i].kind != INSN_REF ||
+           !is_op(c, i+1, JMP) || is_here(c[i].name) )
+        break;
+
+      c[n].name = c[i].name;
+    }
+  }
+}
+
+template<typename word_t>
+void optimize(std::vector<insn_t<word_t> >& code, size_t inline_cells)
+{
+  const label_table_t data = data_labels(code);
+  inline_calls(code, data, inline_cells);
+  peephole(code, data);
+  thread_jumps(code, data);
+}
+
+template void optimize(std::vector<insn_t<int32_t> >&, size_t);
+template void optimize(std::vector<insn_t<int64_t> >&, size_t);
@@ -0,0 +1,45 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdlib.h>
+#include <new>
+#include "pages.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+# define HAVE_MMAP
+# include <sys/mman.h>
+#endif
+
+void* page_alloc(size_t bytes)
+{
+#ifdef HAVE_MMAP
+  void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if ( p == MAP_FAILED )
+    throw std::bad_alloc();
+#else
+  void *p = calloc(bytes, 1);
+
+  if ( p == NULL )
+    throw std::bad_alloc();
+#endif
+
+  return p;
+}
+
+void page_free(void* p, size_t bytes)
+{
+#ifdef HAVE_MMAP
+  if ( p != NULL )
+    munmap(p, bytes);
+#else
+  (void) bytes;
+  free(p);
+#endif
+}
@@ -7,9 +7,21 @@
  */
 
 #include <stdio.h>
-#include <ctype.h>
 #include "parser.hpp"
 
+#if defined(__unix__) || defined(__APPLE__)
+# define HAVE_MMAP
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+// isspace() in the C locale, without a function call
+static inline bool is_space(int c)
+{
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' ||
+         c == '\f';
+}
+
 int parser::update_lineno(int c)
 {
   if ( c == '\n' )
@@ -33,38 +45,114 @@ void parser::move_back(int c)
 
 void parser::skip_whitespace()
 {
+  if ( f == NULL ) {
+    for ( ; pos < end && is_space(*pos); ++pos )
+      if ( *pos == '\n' )
+        ++lineno;
+    return;
+  }
+
   int c;
-  while ( (c = fgetchar()) != EOF && isspace(c) )
+  while ( (c = fgetchar()) != EOF && is_space(c) )
     ;
   move_back(c);
 }
 
 parser::parser(FILE* file) :
   f(file),
-  lineno(1)
+  pos(NULL),
+  end(NULL),
+  map(NULL),
+  map_length(0),
+  lineno(1),
+  token_lineno(1),
+  token()
 {
+#ifdef HAVE_MMAP
+  // start where the file has been read up to, as reading it would
+  struct stat st;
+  const int fd = fileno(file);
+  const long offset = ftell(file);
+
+  if ( fd < 0 || offset < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+       || st.st_size <= offset )
+    return;
+
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+  if ( p == MAP_FAILED )
+    return;
+
+  // leave the stream at its end, as reading it would, so that a program
+  // reading the same stream gets what follows the source
+  fseek(file, 0, SEEK_END);
+
+  map = p;
+  map_length = st.st_size;
+  pos = static_cast<const char*>(p) + offset;
+  end = static_cast<const char*>(p) + st.st_size;
+  f = NULL;
+#endif
 }
 
-int parser::get_lineno() const
+parser::parser(const char* source, size_t length) :
+  f(NULL),
+  pos(source),
+  end(source + length),
+  map(NULL),
+  map_length(0),
+  lineno(1),
+  token_lineno(1),
+  token()
 {
-  return lineno;
 }
 
-std::string parser::next_token()
+parser::~parser()
 {
-  int c;
-  std::string s;
+#ifdef HAVE_MMAP
+  if ( map != NULL )
+    munmap(map, map_length);
+#endif
+}
 
+int parser::get_lineno() const
+{
+  return token_lineno;
+}
+
+std::string_view parser::next_token()
+{
   skip_whitespace();
+  token_lineno = lineno;
+
+  if ( f == NULL ) {
+    const char *start = pos;
 
-  while ( (c = fgetchar()) != EOF && !isspace(c) )
-      s += c;
+    while ( pos < end && !is_space(*pos) )
+      ++pos;
 
-  return s;
+    return std::string_view(start, pos - start);
+  }
+
+  // the token keeps its capacity, so reading it seldom allocates
+  int c;
+  token.clear();
+
+  while ( (c = fgetchar()) != EOF && !is_space(c) )
+    token += c;
+
+  move_back(c);
+  return token;
 }
 
 void parser::skip_line()
 {
+  if ( f == NULL ) {
+    while ( pos < end && update_lineno(*pos++) != '\n' )
+      ;
+    return;
+  }
+
   int c;
   while ( (c = fgetchar()) != EOF && c != '\n' )
     ;
@@ -0,0 +1,156 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "pool.hpp"
+
+namespace {
+
+/*
+ * The jobs not yet taken from a thread's share, as the range [lo, hi)
+ * packed into one word, so that the owner and thieves can both update it
+ * with a single compare-and-swap.
+ */
+class share_t {
+  std::atomic<uint64_t> range;
+
+  static uint64_t pack(uint32_t lo, uint32_t hi)
+  {
+    return static_cast<uint64_t>(hi) << 32 | lo;
+  }
+
+public:
+  share_t() : range(0)
+  {
+  }
+
+  void set(uint32_t lo, uint32_t hi)
+  {
+    range.store(pack(lo, hi));
+  }
+
+  // take the job at the front
+  bool take(uint32_t& job)
+  {
+    uint64_t r = range.load();
+
+    for (;;) {
+      uint32_t lo = r, hi = r >> 32;
+
+      if ( lo == hi )
+        return false;
+
+      if ( range.compare_exchange_weak(r, pack(lo + 1, hi)) ) {
+        job = lo;
+        return true;
+      }
+    }
+  }
+
+  // take half of the jobs at the back
+  bool steal(uint32_t& lo_out, uint32_t& hi_out)
+  {
+    uint64_t r = range.load();
+
+    for (;;) {
+      uint32_t lo = r, hi = r >> 32;
+
+      if ( lo == hi )
+        return false;
+
+      uint32_t mid = hi - (hi - lo + 1) / 2;
+
+      if ( range.compare_exchange_weak(r, pack(lo, mid)) ) {
+        lo_out = mid;
+        hi_out = hi;
+        return true;
+      }
+    }
+  }
+};
+
+struct work_t {
+  std::vector<share_t> shares;
+  void (*fn)(size_t, void*);
+  void *arg;
+
+  work_t(size_t threads, void (*f)(size_t, void*), void* a) :
+    shares(threads), fn(f), arg(a)
+  {
+  }
+
+private:
+  work_t(const work_t&); // deny
+  work_t& operator=(const work_t&); // deny
+};
+
+void worker(work_t* w, size_t self)
+{
+  const size_t n = w->shares.size();
+  share_t& mine = w->shares[self];
+
+  for (;;) {
+    uint32_t job;
+
+    while ( mine.take(job) )
+      w->fn(job, w->arg);
+
+    // our share is empty, so nobody else changes it until we refill it
+    uint32_t lo, hi;
+    size_t v = 1;
+
+    for ( ; v < n; ++v )
+      if ( w->shares[(self + v) % n].steal(lo, hi) ) {
+        mine.set(lo, hi);
+        break;
+      }
+
+    if ( v == n )
+      return;
+  }
+}
+
+}
+
+pool_t::pool_t(size_t threads) :
+  nthreads(threads)
+{
+  if ( nthreads == 0 )
+    nthreads = std::thread::hardware_concurrency();
+
+  if ( nthreads == 0 )
+    nthreads = 1;
+}
+
+size_t pool_t::threads() const
+{
+  return nthreads;
+}
+
+void pool_t::run(size_t jobs, void (*fn)(size_t job, void* arg), void* arg)
+{
+  const size_t n = nthreads < jobs ? nthreads : (jobs ? jobs : 1);
+  work_t w(n, fn, arg);
+
+  for ( size_t t = 0; t < n; ++t )
+    w.shares[t].set(jobs*t/n, jobs*(t + 1)/n);
+
+  // the calling thread is one of the workers
+  std::vector<std::thread> threads;
+
+  for ( size_t t = 1; t < n; ++t )
+    threads.push_back(std::thread(worker, &w, t));
+
+  worker(&w, 0);
+
+  for ( size_t t = 0; t < threads.size(); ++t )
+    threads[t].join();
+}
@@ -0,0 +1,300 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include <map>
+#include <algorithm>
+#include "profile.hpp"
+#include "pages.hpp"
+
+// Number of addresses listed by report()
+static const size_t HOTTEST = 20;
+
+profile_t::profile_t() :
+  memsize(0),
+  wordsize(sizeof(int32_t)),
+  hits(NULL),
+  owner(NULL),
+  names(),
+  index(),
+  positions(),
+  frames(1),
+  children(),
+  stacks(),
+  frame(0),
+  leaf(0),
+  current(NULL)
+{
+  memset(ops, 0, sizeof(ops));
+  frames[0].parent = 0;
+  frames[0].ret = 0;
+}
+
+profile_t::~profile_t()
+{
+  if ( hits )
+    page_free(hits, memsize*sizeof(uint64_t));
+
+  if ( owner )
+    page_free(owner, memsize*sizeof(int32_t));
+}
+
+template<typename word_t>
+void profile_t::start(size_t memory_words, const std::vector<label_t>& labels,
+                      const word_t* stackip, size_t depth)
+{
+  wordsize = sizeof(word_t);
+
+  if ( memory_words != memsize ) {
+    // counts for a different memory mean nothing, so start over
+    if ( hits )
+      page_free(hits, memsize*sizeof(uint64_t));
+
+    if ( owner )
+      page_free(owner, memsize*sizeof(int32_t));
+
+    owner = NULL;
+    memset(ops, 0, sizeof(ops));
+    names.clear();
+    index.clear();
+    positions.clear();
+    frames.resize(1);
+    children.clear();
+    stacks.clear();
+    memsize = memory_words;
+    hits = static_cast<uint64_t*>(page_alloc(memsize*sizeof(uint64_t)));
+  }
+
+  if ( owner ) {
+    page_free(owner, memsize*sizeof(int32_t));
+    owner = NULL;
+  }
+
+  // labels are numbered by name, so that counts from earlier runs keep
+  // their meaning if labels are added in between
+  std::vector<std::pair<uint32_t, int32_t> > sorted;
+
+  for ( size_t n=0; n < labels.size(); ++n ) {
+    uint32_t s = static_cast<uint32_t>(labels[n].pos) / wordsize;
+
+    if ( labels[n].pos < 0 || s >= memsize )
+      continue;
+
+    std::unordered_map<std::string, int32_t>::iterator i =
+      index.find(labels[n].name);
+
+    if ( i == index.end() ) {
+      i = index.insert(std::make_pair(labels[n].name,
+                       static_cast<int32_t>(names.size()))).first;
+      names.push_back(labels[n].name);
+      positions.push_back(labels[n].pos);
+    }
+
+    positions[i->second] = labels[n].pos;
+    sorted.push_back(std::make_pair(s, i->second));
+  }
+
+  if ( !sorted.empty() ) {
+    std::stable_sort(sorted.begin(), sorted.end());
+    owner = static_cast<int32_t*>(page_alloc(memsize*sizeof(int32_t)));
+
+    int32_t l = -1;
+    size_t next = 0;
+
+    for ( uint32_t s=0; s < memsize; ++s ) {
+      // of several labels at the same slot, the first one wins
+      if ( next < sorted.size() && sorted[next].first == s ) {
+        l = sorted[next].second;
+
+        while ( next < sorted.size() && sorted[next].first == s )
+          ++next;
+      }
+
+      owner[s] = l;
+    }
+  }
+
+  frame = 0;
+  current = NULL;
+
+  for ( size_t n=0; n < depth; ++n )
+    call(static_cast<int32_t>(stackip[n]));
+}
+
+template void profile_t::start(size_t, const std::vector<label_t>&,
+                               const int32_t*, size_t);
+template void profile_t::start(size_t, const std::vector<label_t>&,
+                               const int64_t*, size_t);
+
+uint64_t profile_t::total() const
+{
+  uint64_t sum = 0;
+
+  for ( size_t n=0; n <= NOP_END; ++n )
+    sum += ops[n];
+
+  return sum;
+}
+
+void profile_t::call(int32_t ret)
+{
+  uint64_t k = key(frame, ret);
+  std::unordered_map<uint64_t, int32_t>::iterator i = children.find(k);
+
+  if ( i == children.end() ) {
+    frame_t f;
+    f.parent = frame;
+    f.ret = ret;
+    i = children.insert(std::make_pair(k,
+          static_cast<int32_t>(frames.size()))).first;
+    frames.push_back(f);
+  }
+
+  frame = i->second;
+  current = NULL;
+}
+
+void profile_t::ret()
+{
+  frame = frames[frame].parent;
+  current = NULL;
+}
+
+std::string profile_t::name(int32_t label) const
+{
+  char buf[32];
+
+  if ( label >= 0 )
+    return names[label];
+
+  if ( label == -1 )
+    return "(start)";
+
+  sprintf(buf, "0x%x", (-2 - label)*static_cast<int32_t>(wordsize));
+  return buf;
+}
+
+// Names the code containing an address, such as a return address
+std::string profile_t::where(int32_t adr) const
+{
+  uint32_t s = static_cast<uint32_t>(adr) / wordsize;
+  char buf[32];
+
+  if ( adr >= 0 && adr % wordsize == 0 && s < memsize )
+    return name(label_at(s));
+
+  sprintf(buf, "0x%x", adr);
+  return buf;
+}
+
+template<typename T>
+static bool by_count(const std::pair<uint64_t, T>& a,
+                     const std::pair<uint64_t, T>& b)
+{
+  return a.first > b.first;
+}
+
+static double percent(uint64_t n, uint64_t total)
+{
+  return total ? 100.0*n/total : 0.0;
+}
+
+void profile_t::report(FILE* f) const
+{
+  const uint64_t sum = total();
+
+  fprintf(f, "Profile of %" PRIu64 " instructions\n\n", sum);
+  fprintf(f, "%14s %7s  %s\n", "count", "%", "opcode");
+
+  std::vector<std::pair<uint64_t, size_t> > byop;
+
+  for ( size_t n=0; n <= NOP_END; ++n )
+    if ( ops[n] )
+      byop.push_back(std::make_pair(ops[n], n));
+
+  std::stable_sort(byop.begin(), byop.end(), by_count<size_t>);
+
+  for ( size_t n=0; n < byop.size(); ++n )
+    fprintf(f, "%14" PRIu64 " %6.2f%%  %s\n", byop[n].first,
+      percent(byop[n].first, sum),
+      byop[n].second < NOP_END ?
+        OpStr[byop[n].second] : "(unknown)");
+
+  std::vector<std::pair<uint64_t, uint32_t> > byslot;
+
+  for ( uint32_t s=0; hits && s < memsize; ++s )
+    if ( hits[s] )
+      byslot.push_back(std::make_pair(hits[s], s));
+
+  if ( owner ) {
+    std::vector<uint64_t> counts(names.size() + 1);
+
+    for ( size_t n=0; n < byslot.size(); ++n )
+      counts[owner[byslot[n].second] + 1] += byslot[n].first;
+
+    std::vector<std::pair<uint64_t, int32_t> > bylabel;
+
+    for ( size_t n=0; n < counts.size(); ++n )
+      if ( counts[n] )
+        bylabel.push_back(std::make_pair(counts[n],
+                          static_cast<int32_t>(n) - 1));
+
+    std::stable_sort(bylabel.begin(), bylabel.end(), by_count<int32_t>);
+
+    fprintf(f, "\n%14s %7s  %s\n", "count", "%", "label");
+
+    for ( size_t n=0; n < bylabel.size(); ++n )
+      fprintf(f, "%14" PRIu64 " %6.2f%%  %s\n", bylabel[n].first,
+        percent(bylabel[n].first, sum), name(bylabel[n].second).c_str());
+  }
+
+  std::stable_sort(byslot.begin(), byslot.end(), by_count<uint32_t>);
+
+  if ( byslot.size() > HOTTEST )
+    byslot.resize(HOTTEST);
+
+  fprintf(f, "\n%14s %7s  %-10s  %s\n", "count", "%", "address", "label");
+
+  for ( size_t n=0; n < byslot.size(); ++n ) {
+    const int32_t adr = byslot[n].second*wordsize;
+    const int32_t l = label_at(byslot[n].second);
+
+    fprintf(f, "%14" PRIu64 " %6.2f%%  0x%08x", byslot[n].first,
+      percent(byslot[n].first, sum), adr);
+
+    if ( l >= 0 )
+      fprintf(f, "  %s+0x%x", names[l].c_str(), adr - positions[l]);
+
+    fprintf(f, "\n");
+  }
+}
+
+void profile_t::folded(FILE* f) const
+{
+  // different return addresses in the same function fold into one line
+  std::map<std::string, uint64_t> lines;
+
+  for ( std::unordered_map<uint64_t, uint64_t>::const_iterator i =
+          stacks.begin(); i != stacks.end(); ++i )
+  {
+    if ( i->second == 0 )
+      continue;
+
+    std::string line = name(static_cast<int32_t>(i->first));
+
+    for ( int32_t fr = i->first >> 32; fr != 0; fr = frames[fr].parent )
+      line = where(frames[fr].ret) + ";" + line;
+
+    lines[line] += i->second;
+  }
+
+  for ( std::map<std::string, uint64_t>::const_iterator i = lines.begin();
+        i != lines.end(); ++i )
+    fprintf(f, "%s %" PRIu64 "\n", i->first.c_str(), i->second);
+}
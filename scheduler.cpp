@@ -0,0 +1,186 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stdexcept>
+#include "scheduler.hpp"
+
+#ifdef __linux__
+# define HAVE_EPOLL
+# include <sys/epoll.h>
+#endif
+
+// Number of events taken from epoll at a time
+static const int EVENTS = 64;
+
+template<typename word_t>
+basic_scheduler_t<word_t>::basic_scheduler_t(uint64_t instructions_per_slice) :
+  slice(instructions_per_slice),
+  tasks(),
+  ready(),
+  live(0),
+  parked(0),
+  epfd(-1),
+  waiting()
+{
+#ifdef HAVE_EPOLL
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+
+  if ( epfd < 0 )
+    throw std::runtime_error("Could not create epoll instance");
+#endif
+}
+
+template<typename word_t>
+basic_scheduler_t<word_t>::~basic_scheduler_t()
+{
+  if ( epfd >= 0 )
+    close(epfd);
+}
+
+template<typename word_t>
+size_t basic_scheduler_t<word_t>::add(basic_machine_t<word_t>* m)
+{
+  task_t t;
+  t.m = m;
+  t.fd = fileno(m->get_fin());
+  t.armed = false;
+
+  int flags = fcntl(t.fd, F_GETFL);
+
+  if ( flags < 0 || fcntl(t.fd, F_SETFL, flags | O_NONBLOCK) < 0 )
+    throw std::runtime_error("Could not make input non-blocking");
+
+  tasks.push_back(t);
+  ready.push_back(tasks.size() - 1);
+  ++live;
+
+  return tasks.size() - 1;
+}
+
+// Waits for input for a task, without running it in the meantime
+template<typename word_t>
+void basic_scheduler_t<word_t>::park(size_t id)
+{
+  task_t& t = tasks[id];
+
+#ifdef HAVE_EPOLL
+  epoll_event ev;
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.u64 = id;
+
+  if ( epoll_ctl(epfd, t.armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                 t.fd, &ev) < 0 )
+  {
+    // input that cannot be waited for is always ready
+    ready.push_back(id);
+    return;
+  }
+#else
+  waiting.push_back(id);
+#endif
+
+  t.armed = true;
+  ++parked;
+}
+
+// Moves parked tasks with input to the ready queue, waiting for at least
+// one if `block` is set
+template<typename word_t>
+void basic_scheduler_t<word_t>::wake(bool block)
+{
+  if ( parked == 0 )
+    return;
+
+#ifdef HAVE_EPOLL
+  epoll_event ev[EVENTS];
+  int n;
+
+  do {
+    n = epoll_wait(epfd, ev, EVENTS, block ? -1 : 0);
+  } while ( n < 0 && errno == EINTR );
+
+  for ( int i=0; i < n; ++i ) {
+    ready.push_back(ev[i].data.u64);
+    --parked;
+  }
+#else
+  std::vector<pollfd> fds(waiting.size());
+
+  for ( size_t i=0; i < waiting.size(); ++i ) {
+    fds[i].fd = tasks[waiting[i]].fd;
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
+
+  int n;
+
+  do {
+    n = poll(&fds[0], fds.size(), block ? -1 : 0);
+  } while ( n < 0 && errno == EINTR );
+
+  size_t kept = 0;
+
+  for ( size_t i=0; i < waiting.size(); ++i )
+    if ( n > 0 && fds[i].revents ) {
+      ready.push_back(waiting[i]);
+      --parked;
+    } else
+      waiting[kept++] = waiting[i];
+
+  waiting.resize(kept);
+#endif
+}
+
+/*
+ * Runs the ready tasks in turn, one slice each.  After every pass through
+ * the tasks that were ready, parked tasks whose input has arrived join
+ * the back of the queue.
+ */
+template<typename word_t>
+void basic_scheduler_t<word_t>::run(done_fn done, void* arg)
+{
+  while ( live > 0 ) {
+    wake(ready.empty());
+
+    for ( size_t n = ready.size(); n > 0; --n ) {
+      const size_t id = ready.front();
+      ready.pop_front();
+
+      basic_machine_t<word_t> *m = tasks[id].m;
+      const run_status_t s = m->run_for(slice);
+
+      switch ( s ) {
+      case STATUS_EXHAUSTED:
+        ready.push_back(id);
+        break;
+
+      case STATUS_WAITING:
+        park(id);
+        break;
+
+      default:
+#ifdef HAVE_EPOLL
+        if ( tasks[id].armed )
+          epoll_ctl(epfd, EPOLL_CTL_DEL, tasks[id].fd, NULL);
+#endif
+        tasks[id].m = NULL;
+        --live;
+        done(id, m, s, arg);
+        break;
+      }
+    }
+  }
+}
+
+template class basic_scheduler_t<int32_t>;
+template class basic_scheduler_t<int64_t>;
@@ -0,0 +1,30 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include "size.hpp"
+
+size_t parse_size(const char* s)
+{
+  if ( !isdigit(static_cast<unsigned char>(*s)) )
+    return 0;
+
+  char *end;
+  unsigned long long n = strtoull(s, &end, 10);
+
+  switch ( toupper(static_cast<unsigned char>(*end)) ) {
+  case 'K': n <<= 10; ++end; break;
+  case 'M': n <<= 20; ++end; break;
+  }
+
+  if ( *end != '\0' || n != static_cast<size_t>(n) )
+    return 0;
+
+  return static_cast<size_t>(n);
+}
@@ -10,23 +10,117 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
+#include <stdexcept>
 #include "instructions.hpp"
 #include "fileptr.hpp"
 #include "compiler.hpp"
 #include "error.hpp"
-#include "upper.hpp"
+#include "size.hpp"
 
-void compile_and_run(FILE* f)
+static int jit_threshold = -1;
+static size_t memory_words = MEMORY_WORDS;
+static bool profiling = false;
+static FILE* folded = NULL; // where to write folded call stacks
+static bool stats = false;
+static uint64_t slice = 0; // instructions per run_for(), or zero for run()
+static bool slices = false; // report the slices run
+static bool optimizing = false;
+static size_t inline_cells = INLINE_CELLS;
+static int word_bits = 32;
+
+template<typename word_t>
+static void report(const basic_machine_t<word_t>& m)
 {
+  if ( stats )
+    m.get_stats()->json(stderr);
+
+  const profile_t *p = m.get_profile();
+
+  if ( p == NULL )
+    return;
+
+  p->report(stderr);
+
+  if ( folded )
+    p->folded(folded);
+}
+
+template<typename word_t>
+static void compile_and_run_as(FILE* f)
+{
+  if ( memory_words > basic_machine_t<word_t>::MAX_WORDS )
+    error("Too many memory cells for the word size");
+
   parser p(f);
-  compiler c(p, error);
-  c.get_program().run();
+  basic_compiler<word_t> c(p, error, memory_words, optimizing,
+                           inline_cells);
+
+  if ( jit_threshold >= 0 )
+    c.get_program().set_jit_threshold(jit_threshold);
+
+  c.get_program().set_profiling(profiling);
+  c.get_program().collect_stats(stats);
+
+  if ( slice > 0 ) {
+    basic_machine_t<word_t>& m = c.get_program();
+    uint64_t runs = 0, longest = 0, last = 0;
+    run_status_t s;
+
+    m.count_instructions(slices);
+    m.start();
+
+    do {
+      s = m.run_for(slice);
+      ++runs;
+      longest = std::max(longest, m.instructions() - last);
+      last = m.instructions();
+    } while ( s == STATUS_EXHAUSTED );
+
+    if ( slices )
+      fprintf(stderr, "{\"slices\":%llu,\"longest\":%llu}\n",
+              static_cast<unsigned long long>(runs),
+              static_cast<unsigned long long>(longest));
+  } else
+    c.get_program().run();
+
+  report(c.get_program());
+}
+
+void compile_and_run(FILE* f)
+{
+  if ( word_bits == 64 )
+    compile_and_run_as<int64_t>(f);
+  else
+    compile_and_run_as<int32_t>(f);
 }
 
 void help()
 {
-  printf("Usage: sm [ file(s] ]\n");
+  printf("Usage: sm [ -O ] [ -i cells ] [ -j jumps ] [ -m cells ]\n");
+  printf("          [ -w bits ] [ --profile ] [ --folded file ]\n");
+  printf("          [ --stats ] [ -s steps ] [ --slices ] [ file(s) ]\n");
   printf("Compiles and runs source files on the fly.\n\n");
+  printf("  -O        optimize the code; addresses must come from labels\n");
+  printf("  -i cells  with -O, inline functions of up to this many cells\n");
+  printf("            (default %lu)\n", INLINE_CELLS);
+  printf("  -j jumps  compile code to native after this many jumps to it,\n");
+  printf("            or never if zero\n");
+  printf("  -m cells  size of memory, optionally suffixed with K or M\n");
+  printf("            (default %luK)\n", MEMORY_WORDS/1024);
+  printf("  -w bits   size of memory cells and stack entries, 32 or 64\n");
+  printf("            (default 32); only 32-bit code is compiled to native\n");
+  printf("  --profile count instructions by opcode, label and address, and\n");
+  printf("            print them to stderr; runs without native code\n");
+  printf("  --folded file\n");
+  printf("            profile, and write call stacks to file in the folded\n");
+  printf("            format read by flamegraph.pl\n");
+  printf("  --stats   print resource usage to stderr as a line of JSON;\n");
+  printf("            runs without native code\n");
+  printf("  -s steps  run in slices of this many instructions, resuming\n");
+  printf("            after each one\n");
+  printf("  --slices  with -s, print to stderr the number of slices and\n");
+  printf("            the most instructions run in one, as JSON\n\n");
   exit(1);
 }
 
@@ -40,7 +134,35 @@ int main(int argc, char** argv)
       if ( argv[n][0]=='-' ) {
         if ( argv[n][1] == '\0' )
           compile_and_run(stdin);
-        else
+        else if ( !strcmp(argv[n], "-j") && n+1 < argc )
+          jit_threshold = atoi(argv[++n]);
+        else if ( !strcmp(argv[n], "-O") )
+          optimizing = true;
+        else if ( !strcmp(argv[n], "-i") && n+1 < argc )
+          inline_cells = atoi(argv[++n]);
+        else if ( !strcmp(argv[n], "-s") && n+1 < argc )
+          slice = parse_size(argv[++n]);
+        else if ( !strcmp(argv[n], "-m") && n+1 < argc ) {
+          memory_words = parse_size(argv[++n]);
+          if ( memory_words == 0 || memory_words > MAX_MEMORY_WORDS )
+            help();
+        } else if ( !strcmp(argv[n], "-w") && n+1 < argc ) {
+          word_bits = atoi(argv[++n]);
+          if ( word_bits != 32 && word_bits != 64 )
+            help();
+        } else if ( !strcmp(argv[n], "--profile") )
+          profiling = true;
+        else if ( !strcmp(argv[n], "--stats") )
+          stats = true;
+        else if ( !strcmp(argv[n], "--slices") )
+          slices = true;
+        else if ( !strcmp(argv[n], "--folded") && n+1 < argc ) {
+          profiling = true;
+          folded = fopen(argv[++n], "wt");
+
+          if ( folded == NULL )
+            throw std::runtime_error("Could not open file");
+        } else
           help();
       } else
         compile_and_run(fileptr(fopen(argv[n], "rt")));
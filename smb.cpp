@@ -0,0 +1,466 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ * Synopsis:  Benchmark the machine, parser and compiler.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include "version.hpp"
+#include "instructions.hpp"
+#include "fileptr.hpp"
+#include "compiler.hpp"
+#include "error.hpp"
+#include "vecops.hpp"
+
+// Each measurement is repeated until it has taken this long, and the best
+// of ROUNDS measurements is reported
+static double min_seconds = 0.1;
+static const int ROUNDS = 3;
+
+static FILE *devnull = NULL;
+static FILE *devzero = NULL;
+
+static double seconds()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+/*
+ * Every result is one line: the name of the benchmark, a rate and the
+ * time per operation.  Keep the format stable, so that results from
+ * different versions can be compared line by line.
+ */
+static void report(const std::string& name, double ops, double secs,
+                   const char* rate, double scale = 1e6)
+{
+  printf("%-32s %12.3f %-8s %12.3f ns/op\n", name.c_str(),
+    secs > 0 ? ops/secs/scale : 0.0, rate, ops > 0 ? secs*1e9/ops : 0.0);
+  fflush(stdout);
+}
+
+/*
+ * End-to-end workloads.  Each file is compiled once, and every run starts
+ * from a fresh copy of it, interpreted and with native code.
+ */
+static void bench_program(const char* file, int jit_threshold,
+                          const char* mode)
+{
+  fileptr f(fopen(file, "rt"));
+  parser p(f);
+  compiler c(p, error);
+  snapshot_t image(c.get_program());
+
+  double best = 0, best_secs = 0;
+
+  for ( int r=0; r < ROUNDS; ++r ) {
+    uint64_t ops = 0;
+    double secs = 0;
+
+    while ( secs < min_seconds ) {
+      machine_t m(image);
+      m.set_fin(devzero);
+      m.set_fout(devnull);
+      m.count_instructions(true);
+
+      if ( jit_threshold >= 0 )
+        m.set_jit_threshold(jit_threshold);
+
+      const double start = seconds();
+      m.run();
+      secs += seconds() - start;
+      ops += m.instructions();
+    }
+
+    if ( ops/secs > best ) {
+      best = ops/secs;
+      best_secs = secs/ops;
+    }
+  }
+
+  std::string name(file);
+  name = name.substr(name.rfind('/') + 1) + " " + mode;
+  report(name, 1, best_secs, "MIPS");
+}
+
+/*
+ * Microbenchmarks of the instr_* handlers.  Each call gets its operands
+ * pushed first, and its results popped afterwards, with the public
+ * push(), pop(), puship() and popip(); this is part of the time reported.
+ */
+struct micro_t {
+  const char *name;
+  void (machine_t::*instr)();
+  int args;        // operands pushed from arg[]
+  int32_t arg[3];
+  int results;     // words left on the data stack
+  int ip_args;     // words pushed on the IP stack first
+  int ip_results;  // words left on the IP stack
+};
+
+static const micro_t micros[] = {
+  {"nop",    &machine_t::instr_nop,    0, {0, 0, 0},   0, 0, 0},
+  {"add",    &machine_t::instr_add,    2, {1, 2, 0},   1, 0, 0},
+  {"sub",    &machine_t::instr_sub,    2, {1, 2, 0},   1, 0, 0},
+  {"and",    &machine_t::instr_and,    2, {1, 2, 0},   1, 0, 0},
+  {"or",     &machine_t::instr_or,     2, {1, 2, 0},   1, 0, 0},
+  {"xor",    &machine_t::instr_xor,    2, {1, 2, 0},   1, 0, 0},
+  {"not",    &machine_t::instr_not,    1, {1, 0, 0},   1, 0, 0},
+  {"compl",  &machine_t::instr_compl,  1, {1, 0, 0},   1, 0, 0},
+  {"in",     &machine_t::instr_in,     0, {0, 0, 0},   1, 0, 0},
+  {"out",    &machine_t::instr_out,    1, {'x', 0, 0}, 0, 0, 0},
+  {"outnum", &machine_t::instr_outnum, 1, {12345, 0, 0}, 0, 0, 0},
+  {"load",   &machine_t::instr_load,   1, {64, 0, 0},  1, 0, 0},
+  {"stor",   &machine_t::instr_stor,   2, {1, 64, 0},  0, 0, 0},
+  {"jmp",    &machine_t::instr_jmp,    1, {8, 0, 0},   0, 0, 0},
+  {"jz",     &machine_t::instr_jz,     2, {8, 0, 0},   0, 0, 0},
+  {"jnz",    &machine_t::instr_jnz,    2, {8, 1, 0},   0, 0, 0},
+  {"push",   &machine_t::instr_push,   0, {0, 0, 0},   1, 0, 0},
+  {"puship", &machine_t::instr_puship, 0, {0, 0, 0},   0, 0, 1},
+  {"dup",    &machine_t::instr_dup,    1, {1, 0, 0},   2, 0, 0},
+  {"swap",   &machine_t::instr_swap,   2, {1, 2, 0},   2, 0, 0},
+  {"rol3",   &machine_t::instr_rol3,   3, {1, 2, 3},   3, 0, 0},
+  {"drop",   &machine_t::instr_drop,   1, {1, 0, 0},   0, 0, 0},
+  {"popip",  &machine_t::instr_popip,  0, {0, 0, 0},   0, 1, 0},
+  {"dropip", &machine_t::instr_dropip, 0, {0, 0, 0},   0, 1, 0},
+  {"read",   &machine_t::instr_read,   2, {64, 16, 0}, 1, 0, 0},
+  {"write",  &machine_t::instr_write,  2, {64, 16, 0}, 1, 0, 0},
+};
+
+static double time_micro(machine_t& m, const micro_t& t, size_t iterations)
+{
+  const double start = seconds();
+
+  for ( size_t n=0; n < iterations; ++n ) {
+    m.start();
+
+    for ( int i=0; i < t.args; ++i )
+      m.push(t.arg[i]);
+
+    for ( int i=0; i < t.ip_args; ++i )
+      m.puship(8);
+
+    (m.*t.instr)();
+
+    for ( int i=0; i < t.results; ++i )
+      m.pop();
+
+    for ( int i=0; i < t.ip_results; ++i )
+      m.popip();
+  }
+
+  return seconds() - start;
+}
+
+static void bench_micros()
+{
+  machine_t m(64*1024, devnull, devzero);
+
+  for ( size_t n=0; n < sizeof(micros)/sizeof(micro_t); ++n ) {
+    const micro_t& t = micros[n];
+    size_t iterations = 1000;
+
+    // size the runs to take about the minimum time
+    while ( time_micro(m, t, iterations) < min_seconds )
+      iterations *= 2;
+
+    double best = 0;
+
+    for ( int r=0; r < ROUNDS; ++r ) {
+      const double secs = time_micro(m, t, iterations);
+
+      if ( r == 0 || secs < best )
+        best = secs;
+    }
+
+    report(std::string("machine_t::instr_") + t.name, iterations, best,
+      "MIPS");
+  }
+}
+
+/*
+ * Instructions over large ranges of cells, where the time per cell is
+ * what matters.  There are three ranges one after the other, and MEMCMP
+ * runs after MEMCPY has made the ranges it compares equal.
+ */
+struct range_t {
+  Op op;
+  int args;
+  int32_t arg[4];
+  int results;
+};
+
+static const int32_t C = 256*1024; // cells in a range
+static const int32_t R0 = 0;       // addresses of the ranges
+static const int32_t R1 = C*sizeof(int32_t);
+static const int32_t R2 = 2*C*sizeof(int32_t);
+
+static const range_t ranges[] = {
+  {VADD, 4, {R2, R0, R1, C}, 0},
+  {VSUB, 4, {R2, R0, R1, C}, 0},
+  {VAND, 4, {R2, R0, R1, C}, 0},
+  {VOR,  4, {R2, R0, R1, C}, 0},
+  {VXOR, 4, {R2, R0, R1, C}, 0},
+  {VSUM, 2, {R0, C, 0, 0}, 1},
+  {VMIN, 2, {R0, C, 0, 0}, 1},
+  {VMAX, 2, {R0, C, 0, 0}, 1},
+  {VDOT, 3, {R0, R1, C, 0}, 1},
+  {MEMCPY, 3, {R2, R0, C, 0}, 0},
+  {MEMCMP, 3, {R0, R2, C, 0}, 1},
+  {MEMSET, 3, {R2, -1, C, 0}, 0},
+  {MEMCHR, 3, {R0, -1, C, 0}, 1},
+};
+
+static void bench_ranges()
+{
+  machine_t m(MEMORY_WORDS, devnull, devzero);
+
+  for ( int32_t n=0; n < 3*C; ++n )
+    m.set_mem(n*sizeof(int32_t), n);
+
+  for ( size_t n=0; n < sizeof(ranges)/sizeof(range_t); ++n ) {
+    const range_t& t = ranges[n];
+    double best = 0;
+
+    for ( int r=0; r < ROUNDS; ++r ) {
+      double secs = 0;
+      size_t calls = 0;
+
+      for ( ; secs < min_seconds; ++calls ) {
+        for ( int i=0; i < t.args; ++i )
+          m.push(t.arg[i]);
+
+        const double start = seconds();
+        m.exec(t.op);
+        secs += seconds() - start;
+
+        for ( int i=0; i < t.results; ++i )
+          m.pop();
+      }
+
+      if ( r == 0 || secs/calls < best )
+        best = secs/calls;
+    }
+
+    std::string name("machine_t::exec ");
+    name += to_s(t.op);
+
+    if ( t.op < MEMCPY )
+      name = name + " " + vecops<int32_t>().name;
+
+    report(name, C, best, "Mcell/s");
+  }
+}
+
+// Source code with many distinct labels, literals and instructions
+static std::string make_source(size_t lines)
+{
+  std::string s;
+  char buf[128];
+
+  for ( size_t n=0; n < lines; ++n ) {
+    sprintf(buf, "label-%lu: %lu &label-%lu load add 'x' swap drop\n",
+      static_cast<unsigned long>(n), static_cast<unsigned long>(n),
+      static_cast<unsigned long>((n*7919) % lines));
+    s += buf;
+  }
+
+  return s + "halt\n";
+}
+
+static size_t count_tokens(parser& p)
+{
+  size_t n = 0;
+
+  while ( !p.next_token().empty() )
+    ++n;
+
+  return n;
+}
+
+// Splits the source in place, or read through a FILE* if `stream` is set
+static size_t count_tokens(const std::string& source, bool stream = false)
+{
+  if ( !stream ) {
+    parser p(source.data(), source.size());
+    return count_tokens(p);
+  }
+
+  fileptr f(fmemopen(const_cast<char*>(source.data()), source.size(), "r"));
+  parser p(f);
+  return count_tokens(p);
+}
+
+static void bench_parser(const std::string& source, const char* name,
+                         bool stream)
+{
+  double best = 0;
+  size_t tokens = 0;
+
+  for ( int r=0; r < ROUNDS; ++r ) {
+    double secs = 0;
+    size_t n = 0;
+
+    for ( ; secs < min_seconds; ++n ) {
+      const double start = seconds();
+      tokens = count_tokens(source, stream);
+      secs += seconds() - start;
+    }
+
+    if ( r == 0 || secs/n < best )
+      best = secs/n;
+  }
+
+  report(name, tokens, best, "Mtoken/s");
+}
+
+static void bench_compiler(const std::string& source, const char* name,
+                           size_t memory_words = MEMORY_WORDS)
+{
+  const size_t tokens = count_tokens(source);
+  double best = 0;
+
+  for ( int r=0; r < ROUNDS; ++r ) {
+    double secs = 0;
+    size_t n = 0;
+
+    for ( ; secs < min_seconds; ++n ) {
+      const double start = seconds();
+      parser p(source.data(), source.size());
+      compiler c(p, error, memory_words);
+      secs += seconds() - start;
+    }
+
+    if ( r == 0 || secs/n < best )
+      best = secs/n;
+  }
+
+  report(name, tokens, best, "Mtoken/s");
+}
+
+// Saves and loads an image that fills the whole memory
+static void bench_images()
+{
+  machine_t m(MEMORY_WORDS, devnull, devzero);
+
+  for ( size_t n=0; n < MEMORY_WORDS; ++n )
+    m.set_mem(n*sizeof(int32_t), n | 1);
+
+  const double bytes = MEMORY_WORDS*sizeof(int32_t);
+  double best_save = 0, best_load = 0;
+
+  for ( int r=0; r < ROUNDS; ++r ) {
+    double save = 0, load = 0;
+    size_t n = 0;
+
+    for ( ; save + load < min_seconds; ++n ) {
+      char *data = NULL;
+      size_t len = 0;
+      FILE *f = open_memstream(&data, &len);
+
+      if ( f == NULL )
+        throw std::runtime_error("Could not open memory stream");
+
+      double start = seconds();
+      m.save_image(f);
+      fflush(f);
+      save += seconds() - start;
+      fclose(f);
+
+      f = fmemopen(data, len, "r");
+
+      if ( f == NULL )
+        throw std::runtime_error("Could not open memory stream");
+
+      start = seconds();
+      m.load_image(f);
+      load += seconds() - start;
+      fclose(f);
+      free(data);
+    }
+
+    if ( r == 0 || save/n < best_save )
+      best_save = save/n;
+
+    if ( r == 0 || load/n < best_load )
+      best_load = load/n;
+  }
+
+  // one operation is one cell
+  report("machine_t::save_image", MEMORY_WORDS, best_save, "MB/s",
+    1e6/bytes*MEMORY_WORDS);
+  report("machine_t::load_image", MEMORY_WORDS, best_load, "MB/s",
+    1e6/bytes*MEMORY_WORDS);
+}
+
+void help()
+{
+  printf("Usage: smb [ -t seconds ] [ file(s) ]\n");
+  printf("Benchmarks the machine, parser and compiler.\n\n");
+  printf("Runs each source file interpreted and with native code, then the\n");
+  printf("instruction handlers, parser, compiler and image loading one by\n");
+  printf("one.  Prints one line per benchmark: its name, a rate, and the\n");
+  printf("time per operation.\n\n");
+  printf("  -t seconds  least time to measure each benchmark for\n");
+  printf("              (default %g)\n\n", min_seconds);
+  exit(1);
+}
+
+int main(int argc, char** argv)
+{
+  try {
+    std::vector<const char*> files;
+
+    for ( int n=1; n<argc; ++n )
+      if ( !strcmp(argv[n], "-t") && n+1 < argc ) {
+        min_seconds = atof(argv[++n]);
+        if ( min_seconds <= 0 )
+          help();
+      } else if ( argv[n][0] == '-' )
+        help();
+      else
+        files.push_back(argv[n]);
+
+    devnull = fopen("/dev/null", "wb");
+    devzero = fopen("/dev/zero", "rb");
+
+    if ( devnull == NULL || devzero == NULL )
+      throw std::runtime_error("Could not open /dev/null or /dev/zero");
+
+    printf("smb %s\n", VERSION);
+
+    for ( size_t n=0; n < files.size(); ++n ) {
+      bench_program(files[n], 0, "interpreted");
+      bench_program(files[n], -1, "native");
+    }
+
+    bench_micros();
+    bench_ranges();
+
+    const std::string source = make_source(5000);
+    bench_parser(source, "parser::next_token", false);
+    bench_parser(source, "parser::next_token, FILE*", true);
+    bench_compiler(source, "compiler");
+
+    // compiling must take time in proportion to the number of labels
+    bench_compiler(make_source(100000), "compiler, 100K labels",
+                   4*MEMORY_WORDS);
+    bench_images();
+
+    return 0;
+  }
+  catch(const std::exception& e) {
+    error(e.what());
+  }
+}
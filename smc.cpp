@@ -19,6 +19,9 @@
 
 const char* file = "";
 parser *p = NULL;
+int word_bits = 32;
+bool optimizing = false;
+size_t inline_cells = INLINE_CELLS;
 
 // Return '<this part>.<ext>' of a filename
 static std::string sbasename(const std::string& s)
@@ -34,22 +37,43 @@ static void compile_error(const char* msg)
   exit(1);
 }
 
-void compile(FILE* f, const std::string& out)
+template<typename word_t>
+static void compile_as(FILE* f, const std::string& out)
 {
   delete(p);
   p = new parser(f);
-  compiler c(*p, compile_error);
+  basic_compiler<word_t> c(*p, compile_error, MEMORY_WORDS, optimizing,
+                           inline_cells);
   c.get_program().save_image( fileptr(fopen(out.c_str(), "wb")));
 }
 
+void compile(FILE* f, const std::string& out)
+{
+  if ( word_bits == 64 )
+    compile_as<int64_t>(f, out);
+  else
+    compile_as<int32_t>(f, out);
+}
+
 int main(int argc, char** argv)
 {
   try {
     if ( argc < 2 )
-      error("Usage: smc [ filename(s) | - ]\n" VERSION);
+      error("Usage: smc [ -O ] [ -i cells ] [ -w bits ]"
+            " [ filename(s) | - ]\n" VERSION);
 
     for ( int n=1; n<argc; ++n ) {
-      if ( !strcmp(argv[n], "-") ) {
+      if ( !strcmp(argv[n], "-O") )
+        optimizing = true;
+      else if ( !strcmp(argv[n], "-i") && n+1 < argc )
+        inline_cells = atoi(argv[++n]);
+      else if ( !strcmp(argv[n], "-w") && n+1 < argc ) {
+        // images of 64-bit words get a header, see IMAGE64_MAGIC
+        word_bits = atoi(argv[++n]);
+
+        if ( word_bits != 32 && word_bits != 64 )
+          error("Word size must be 32 or 64 bits");
+      } else if ( !strcmp(argv[n], "-") ) {
         file = "<stdin>";
         compile(stdin, "out.sm");
       } else {
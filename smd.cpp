@@ -9,12 +9,16 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include "instructions.hpp"
 #include "machine.hpp"
 #include "fileptr.hpp"
 #include "error.hpp"
+#include "size.hpp"
 
-static bool isprintable(int c)
+static size_t memory_words = MEMORY_WORDS;
+
+static bool isprintable(int64_t c)
 {
   return (c>=32 && c<=127)
     || c=='\n'
@@ -36,17 +40,20 @@ static const char* to_s(char c)
   }
 }
 
-static void disassemble(machine_t &m)
+template<typename word_t>
+static void disassemble(basic_machine_t<word_t> &m)
 {
+  typedef typename std::make_unsigned<word_t>::type uword_t;
   int32_t end = m.size();
 
-  while ( m.pos() <= end ) {
+  while ( m.pos() < end ) {
     Op op = static_cast<Op>(m.cur());
     printf("0x%x %s", m.pos(), to_s(op));
 
-    if ( (op==PUSH || op==PUSHIP) && m.pos()<=end ) {
+    if ( op==PUSH || op==PUSHIP ) {
         m.next();
-        printf(" 0x%x", m.cur());
+        printf(" 0x%llx", static_cast<unsigned long long>(
+                            static_cast<uword_t>(m.cur())));
 
         if ( isprintable(m.cur()) )
           printf(" ('%s')", to_s(m.cur()));
@@ -57,10 +64,25 @@ static void disassemble(machine_t &m)
   }
 }
 
+template<typename word_t>
+static void disassemble(const char* file)
+{
+  if ( memory_words > basic_machine_t<word_t>::MAX_WORDS )
+    error("Too many memory cells for the word size");
+
+  basic_machine_t<word_t> m(memory_words);
+  m.load_image(fileptr(fopen(file, "rb")));
+  printf("; File %s --- %lu bytes%s\n", file, m.size(),
+         sizeof(word_t) == sizeof(int64_t) ? ", 64-bit words" : "");
+  disassemble(m);
+}
+
 int help()
 {
-  printf("Usage: smd [ file(s) }\n\n");
-  printf("Disassembles compiled bytecode files.\n");
+  printf("Usage: smd [ -m cells ] [ file(s) ]\n\n");
+  printf("Disassembles compiled bytecode files.\n\n");
+  printf("  -m cells  size of memory, optionally suffixed with K or M\n");
+  printf("            (default %luK)\n", MEMORY_WORDS/1024);
   exit(1);
 }
 
@@ -69,15 +91,20 @@ int main(int argc, char** argv)
   try {
     for ( int n=1; n<argc; ++n ) {
       if ( argv[n][0] == '-' ) {
-        if ( argv[n][1] != '\0' )
+        if ( !strcmp(argv[n], "-m") && n+1 < argc ) {
+          memory_words = parse_size(argv[++n]);
+          if ( memory_words == 0 || memory_words > MAX_MEMORY_WORDS )
+            help();
+        } else if ( argv[n][1] != '\0' )
           help();
         continue;
       }
 
-      machine_t m;
-      m.load_image(fileptr(fopen(argv[n], "rb")));
-      printf("; File %s --- %lu bytes\n", argv[n], m.size());
-      disassemble(m);
+      // the image header tells the word size
+      if ( image_word_bits(argv[n]) == 64 )
+        disassemble<int64_t>(argv[n]);
+      else
+        disassemble<int32_t>(argv[n]);
     }
     return 0;
   }
@@ -10,16 +10,450 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <stdexcept>
 #include "version.hpp"
 #include "instructions.hpp"
 #include "machine.hpp"
 #include "fileptr.hpp"
+#include "size.hpp"
+#include "pool.hpp"
+#include "scheduler.hpp"
+
+static int jit_threshold = -1;
+static size_t memory_words = MEMORY_WORDS;
+static bool batch_mode = false;
+static bool green_mode = false;
+static size_t batch_threads = 0;
+static bool profiling = false;
+static FILE* folded = NULL; // where to write folded call stacks
+static bool stats = false;
+static int word_bits = 32; // of an image read from stdin
+
+template<typename word_t>
+static void run(basic_machine_t<word_t>& m)
+{
+  if ( jit_threshold >= 0 )
+    m.set_jit_threshold(jit_threshold);
+
+  m.run();
+}
+
+// Runs a single program, and reports on it if asked to
+template<typename word_t>
+static void run_single(basic_machine_t<word_t>& m)
+{
+  m.set_profiling(profiling);
+  m.collect_stats(stats);
+  run(m);
+
+  if ( stats )
+    m.get_stats()->json(stderr);
+
+  const profile_t *p = m.get_profile();
+
+  if ( p == NULL )
+    return;
+
+  p->report(stderr);
+
+  if ( folded )
+    p->folded(folded);
+}
+
+/*
+ * Batch mode.  Each file is one program to run, and the same file may be
+ * given many times.  Every distinct image is loaded once, and the machines
+ * running it share its memory copy-on-write.  Programs read from an empty
+ * input, and their output (and statistics) are captured and written in
+ * the order the files were given.
+ */
+template<typename word_t>
+struct batch_t {
+  std::vector<basic_snapshot_t<word_t>*> jobs;
+  std::vector<char*> output;
+  std::vector<size_t> length;
+  std::vector<std::string> stats;
+  std::vector<std::string> errors; // why each job failed, if it did
+  std::vector<char> done;
+  size_t next;  // next output to write
+  std::mutex lock;
+  std::atomic<uint64_t> instructions;
+  FILE *empty;
+
+  batch_t(FILE* empty_input) :
+    jobs(), output(), length(), stats(), errors(), done(), next(0), lock(),
+    instructions(0), empty(empty_input)
+  {
+  }
+
+private:
+  batch_t(const batch_t&); // deny
+  batch_t& operator=(const batch_t&); // deny
+};
+
+template<typename word_t>
+static void run_job(size_t job, void* arg)
+{
+  batch_t<word_t>& b = *static_cast<batch_t<word_t>*>(arg);
+  char *out = NULL;
+  size_t len = 0;
+  FILE *f = NULL;
+  std::string error;
+
+  try {
+    f = open_memstream(&out, &len);
+
+    if ( f == NULL )
+      throw std::runtime_error("Could not capture output");
+
+    basic_machine_t<word_t> m(*b.jobs[job]);
+    m.set_fin(b.empty);
+    m.set_fout(f);
+    m.count_instructions(true);
+    m.collect_stats(stats);
+    run(m);
+    fclose(f);
+    f = NULL;
+    b.instructions += m.instructions();
+
+    if ( stats ) {
+      char *json = NULL;
+      size_t json_len = 0;
+      FILE *g = open_memstream(&json, &json_len);
+
+      if ( g == NULL )
+        throw std::runtime_error("Could not capture output");
+
+      m.get_stats()->json(g);
+      fclose(g);
+      b.stats[job].assign(json, json_len);
+      free(json);
+    }
+  }
+  catch(const std::exception& e) {
+    // the other jobs still run and write their output; batch() fails
+    if ( f )
+      fclose(f);
+
+    error = e.what();
+  }
+
+  // write all output that is next in line
+  std::lock_guard<std::mutex> guard(b.lock);
+  b.output[job] = out;
+  b.length[job] = len;
+  b.errors[job] = error;
+  b.done[job] = 1;
+
+  for ( ; b.next < b.jobs.size() && b.done[b.next]; ++b.next ) {
+    if ( b.output[b.next] )
+      fwrite(b.output[b.next], 1, b.length[b.next], stdout);
+
+    fputs(b.stats[b.next].c_str(), stderr);
+
+    if ( !b.errors[b.next].empty() )
+      fprintf(stderr, "%s\n", b.errors[b.next].c_str());
+
+    free(b.output[b.next]);
+  }
+}
+
+static double seconds()
+{
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+template<typename word_t>
+using images_t = std::map<std::string, basic_snapshot_t<word_t>*>;
+
+// Errors loading an image are fatal, unlike errors running it
+static void fail(const char* s)
+{
+  throw std::runtime_error(s);
+}
+
+template<typename word_t>
+static void check_memory_words()
+{
+  if ( memory_words > basic_machine_t<word_t>::MAX_WORDS )
+    throw std::runtime_error("Too many memory cells for the word size");
+}
+
+template<typename word_t>
+static basic_snapshot_t<word_t>* load_image(FILE* f)
+{
+  check_memory_words<word_t>();
+
+  basic_machine_t<word_t> m(fail, memory_words);
+  m.load_image(f);
+  return new basic_snapshot_t<word_t>(m);
+}
+
+// Loads each distinct file once, and returns a snapshot for each file
+template<typename word_t>
+static std::vector<basic_snapshot_t<word_t>*> load_images(
+  const std::vector<std::string>& files, images_t<word_t>& images)
+{
+  std::vector<basic_snapshot_t<word_t>*> r;
+
+  for ( size_t n=0; n<files.size(); ++n ) {
+    basic_snapshot_t<word_t> *&s = images[files[n]];
+
+    if ( s == NULL )
+      s = load_image<word_t>(fileptr(fopen(files[n].c_str(), "rb")));
+
+    r.push_back(s);
+  }
+
+  return r;
+}
+
+template<typename word_t>
+static void free_images(images_t<word_t>& images)
+{
+  for ( typename images_t<word_t>::iterator i = images.begin();
+        i != images.end(); ++i )
+    delete i->second;
+}
+
+template<typename word_t>
+static void batch(const std::vector<std::string>& files)
+{
+  fileptr empty(fopen("/dev/null", "rb"));
+  batch_t<word_t> b(empty);
+  images_t<word_t> images;
+  b.jobs = load_images(files, images);
+
+  b.output.resize(files.size());
+  b.length.resize(files.size());
+  b.stats.resize(files.size());
+  b.errors.resize(files.size());
+  b.done.resize(files.size());
+
+  pool_t pool(batch_threads);
+  double start = seconds();
+  pool.run(b.jobs.size(), run_job<word_t>, &b);
+  double secs = seconds() - start;
+  fflush(stdout);
+
+  fprintf(stderr, "smr: %lu programs on %lu threads in %.3f s: "
+                  "%.0f programs/s, %.1f MIPS\n",
+    b.jobs.size(), std::min(pool.threads(), b.jobs.size()), secs,
+    b.jobs.size()/secs, b.instructions/secs/1e6);
+
+  free_images(images);
+
+  for ( size_t n=0; n < b.errors.size(); ++n )
+    if ( !b.errors[n].empty() )
+      exit(1);
+}
+
+/*
+ * Green mode.  All files run at once as green threads on this thread, see
+ * scheduler_t.  Each program reads its own copy of standard input through
+ * a pipe, which another thread fills as input arrives, so programs wait
+ * for input as they would on a terminal or a socket.  Their output is
+ * captured and written in the order the files were given.
+ */
+template<typename word_t>
+struct green_t {
+  std::vector<basic_machine_t<word_t>*> machines;
+  std::vector<int> feeds;     // write ends of the input pipes
+  std::vector<FILE*> outputs; // capturing each program's output
+  std::vector<char*> output;
+  std::vector<size_t> length;
+  uint64_t instructions;
+
+  green_t() :
+    machines(), feeds(), outputs(), output(), length(), instructions(0)
+  {
+  }
+};
+
+template<typename word_t>
+static void green_done(size_t id, basic_machine_t<word_t>* m, run_status_t,
+                       void* arg)
+{
+  green_t<word_t>& g = *static_cast<green_t<word_t>*>(arg);
+
+  g.instructions += m->instructions();
+  m->flush();
+  fclose(g.outputs[id]);
+
+  // the feeding thread now gets EPIPE instead of blocking on a full pipe
+  fclose(m->get_fin());
+  m->set_fin(NULL);
+}
+
+static void feed(const std::vector<int>* feeds)
+{
+  char buf[4096];
+  ssize_t got;
+  std::vector<char> open(feeds->size(), 1);
+
+  while ( (got = read(0, buf, sizeof(buf))) != 0 ) {
+    if ( got < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      break;
+    }
+
+    for ( size_t n=0; n < feeds->size(); ++n )
+      for ( ssize_t done = 0; open[n] && done < got; ) {
+        ssize_t w = write((*feeds)[n], buf + done, got - done);
+
+        if ( w < 0 && errno != EINTR )
+          open[n] = 0;
+        else if ( w > 0 )
+          done += w;
+      }
+  }
+
+  for ( size_t n=0; n < feeds->size(); ++n )
+    close((*feeds)[n]);
+}
+
+template<typename word_t>
+static void green(const std::vector<std::string>& files)
+{
+  images_t<word_t> images;
+  std::vector<basic_snapshot_t<word_t>*> jobs = load_images(files, images);
+  green_t<word_t> g;
+  basic_scheduler_t<word_t> sched;
+
+  signal(SIGPIPE, SIG_IGN);
+
+  // each program takes two pipe ends, so allow as many files as we may
+  struct rlimit files_limit;
+
+  if ( getrlimit(RLIMIT_NOFILE, &files_limit) == 0 ) {
+    files_limit.rlim_cur = files_limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files_limit);
+  }
+
+  g.output.resize(jobs.size());
+  g.length.resize(jobs.size());
+
+  for ( size_t n=0; n < jobs.size(); ++n ) {
+    int fds[2];
+
+    if ( pipe(fds) < 0 )
+      throw std::runtime_error("Could not create pipe");
+
+    FILE *in = fdopen(fds[0], "rb");
+    FILE *out = open_memstream(&g.output[n], &g.length[n]);
+
+    if ( in == NULL || out == NULL )
+      throw std::runtime_error("Could not capture output");
+
+    basic_machine_t<word_t> *m = new basic_machine_t<word_t>(*jobs[n]);
+
+    // unless asked for, no native code, which would give every machine
+    // tables as large as its memory
+    m->set_jit_threshold(jit_threshold >= 0 ? jit_threshold : 0);
+
+    m->set_fin(in);
+    m->set_fout(out);
+    m->count_instructions(true);
+    m->start();
+
+    g.machines.push_back(m);
+    g.feeds.push_back(fds[1]);
+    g.outputs.push_back(out);
+    sched.add(m);
+  }
+
+  std::thread feeder(feed, &g.feeds);
+  double start = seconds();
+  sched.run(green_done<word_t>, &g);
+  double secs = seconds() - start;
+  feeder.join();
+
+  for ( size_t n=0; n < jobs.size(); ++n ) {
+    fwrite(g.output[n], 1, g.length[n], stdout);
+    free(g.output[n]);
+    delete g.machines[n];
+  }
+
+  fflush(stdout);
+
+  fprintf(stderr, "smr: %lu green threads in %.3f s: %.1f MIPS\n",
+    jobs.size(), secs, g.instructions/secs/1e6);
+
+  free_images(images);
+}
+
+// Loads an image into the machine that runs it, since there is nothing
+// to share, with errors fatal only while loading
+template<typename word_t>
+static void run_file(FILE* f)
+{
+  check_memory_words<word_t>();
+
+  basic_machine_t<word_t> m(fail, memory_words);
+  m.load_image(f);
+  m.set_error_callback(NULL);
+  run_single(m);
+}
+
+// The word size of the files, which must all have the same
+static int word_bits_of(const std::vector<std::string>& files)
+{
+  int bits = files.empty() ? 32 : image_word_bits(files[0].c_str());
+
+  for ( size_t n=1; n < files.size(); ++n )
+    if ( image_word_bits(files[n].c_str()) != bits )
+      throw std::runtime_error("Images have different word sizes");
+
+  return bits;
+}
 
 static void help()
 {
   printf("smr -- stack-machine run\n");
   printf("%s\n\n", VERSION);
 
+  printf("Usage: smr [ -j jumps ] [ -m cells ] [ -w bits ]\n");
+  printf("           [ -b [ -t threads ] | -g ] [ --profile ]\n");
+  printf("           [ --folded file ] [ --stats ] [ file(s) ]\n\n");
+  printf("  -j jumps    compile code to native after this many jumps\n");
+  printf("              to it, or never if zero; green threads\n");
+  printf("              default to never\n");
+  printf("  -m cells    size of memory, optionally suffixed with K or M\n");
+  printf("              (default %luK)\n", MEMORY_WORDS/1024);
+  printf("  -w bits     word size of an image read from stdin, 32 or\n");
+  printf("              64; files tell their own (default 32)\n");
+  printf("  -b          run the files as a parallel batch, with empty\n");
+  printf("              input, writing their output in order and a\n");
+  printf("              report to stderr; file names are read from\n");
+  printf("              stdin if none are given\n");
+  printf("  -t threads  number of threads in batch mode (default one\n");
+  printf("              per core)\n");
+  printf("  -g          run the files at once as green threads on one\n");
+  printf("              thread, each reading a copy of stdin, writing\n");
+  printf("              their output in order and a report to stderr\n");
+  printf("  --profile   count instructions by opcode and address, and\n");
+  printf("              print them to stderr; runs without native\n");
+  printf("              code, and not in batch mode\n");
+  printf("  --folded file\n");
+  printf("              profile, and write call stacks to file in the\n");
+  printf("              folded format read by flamegraph.pl\n");
+  printf("  --stats     print resource usage of each program to stderr\n");
+  printf("              as a line of JSON; runs without native code\n\n");
+
   printf("Opcodes:\n\n");
 
   Op op=NOP; 
@@ -31,7 +465,7 @@ static void help()
   printf("\nTo halt program, jump to current position:\n\n");
   printf("0x0 PUSH 0x%x\n", (unsigned int)sizeof(int32_t));
   printf("0x%x JMP\n\n", (unsigned int)sizeof(int32_t));
-  printf("Word size is %lu bytes\n", sizeof(int32_t));
+  printf("Word size is %lu or %lu bytes\n", sizeof(int32_t), sizeof(int64_t));
 
   exit(0);
 }
@@ -40,23 +474,79 @@ int main(int argc, char** argv)
 {
   try {
     bool found_file = false;
+    std::vector<std::string> files;
 
     for ( int n=1; n<argc; ++n ) {
       if ( argv[n][0] == '-' ) {
-        help();
+        if ( !strcmp(argv[n], "-j") && n+1 < argc )
+          jit_threshold = atoi(argv[++n]);
+        else if ( !strcmp(argv[n], "-m") && n+1 < argc ) {
+          memory_words = parse_size(argv[++n]);
+          if ( memory_words == 0 || memory_words > MAX_MEMORY_WORDS )
+            help();
+        } else if ( !strcmp(argv[n], "-w") && n+1 < argc ) {
+          word_bits = atoi(argv[++n]);
+          if ( word_bits != 32 && word_bits != 64 )
+            help();
+        } else if ( !strcmp(argv[n], "-b") )
+          batch_mode = true;
+        else if ( !strcmp(argv[n], "-g") )
+          green_mode = true;
+        else if ( !strcmp(argv[n], "-t") && n+1 < argc )
+          batch_threads = atoi(argv[++n]);
+        else if ( !strcmp(argv[n], "--profile") )
+          profiling = true;
+        else if ( !strcmp(argv[n], "--stats") )
+          stats = true;
+        else if ( !strcmp(argv[n], "--folded") && n+1 < argc ) {
+          profiling = true;
+          folded = fopen(argv[++n], "wt");
+
+          if ( folded == NULL )
+            throw std::runtime_error("Could not open file");
+        } else
+          help();
         continue;
       }
       
       found_file = true;
-      machine_t m;
-      m.load_image(fileptr(fopen(argv[n], "rb")));
-      m.run();
+
+      if ( batch_mode || green_mode ) {
+        files.push_back(argv[n]);
+        continue;
+      }
+
+      if ( image_word_bits(argv[n]) == 64 )
+        run_file<int64_t>(fileptr(fopen(argv[n], "rb")));
+      else
+        run_file<int32_t>(fileptr(fopen(argv[n], "rb")));
+    }
+
+    if ( green_mode ) {
+      if ( word_bits_of(files) == 64 )
+        green<int64_t>(files);
+      else
+        green<int32_t>(files);
     }
+    else if ( batch_mode ) {
+      char name[4096];
+
+      while ( !found_file && fgets(name, sizeof(name), stdin) ) {
+        name[strcspn(name, "\r\n")] = '\0';
+
+        if ( name[0] != '\0' )
+          files.push_back(name);
+      }
 
-    if ( !found_file ) {
-      machine_t m;
-      m.load_image(stdin);
-      m.run();
+      if ( word_bits_of(files) == 64 )
+        batch<int64_t>(files);
+      else
+        batch<int32_t>(files);
+    } else if ( !found_file ) {
+      if ( word_bits == 64 )
+        run_file<int64_t>(stdin);
+      else
+        run_file<int32_t>(stdin);
     }
 
     return 0;
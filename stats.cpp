@@ -0,0 +1,114 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include "stats.hpp"
+#include "pages.hpp"
+
+static size_t bitmap_bytes(size_t cells)
+{
+  return (cells + 7) / 8;
+}
+
+stats_t::stats_t() :
+  memsize(0),
+  read(NULL),
+  written(NULL),
+  max_stack(0),
+  max_stackip(0),
+  seconds(0)
+{
+  memset(ops, 0, sizeof(ops));
+}
+
+stats_t::~stats_t()
+{
+  if ( read ) {
+    page_free(read, bitmap_bytes(memsize));
+    page_free(written, bitmap_bytes(memsize));
+  }
+}
+
+void stats_t::start(size_t memory_words)
+{
+  if ( memory_words == memsize )
+    return;
+
+  // cells of a different memory are not the same cells, so start over
+  if ( read ) {
+    page_free(read, bitmap_bytes(memsize));
+    page_free(written, bitmap_bytes(memsize));
+  }
+
+  memsize = memory_words;
+  read = static_cast<uint8_t*>(page_alloc(bitmap_bytes(memsize)));
+  written = static_cast<uint8_t*>(page_alloc(bitmap_bytes(memsize)));
+}
+
+void stats_t::mark(uint8_t* bits, uint32_t first, size_t count)
+{
+  for ( ; count > 0 && (first & 7); --count, ++first )
+    bits[first >> 3] |= 1 << (first & 7);
+
+  memset(bits + (first >> 3), 0xff, count >> 3);
+  first += count & ~7;
+
+  for ( count &= 7; count > 0; --count, ++first )
+    bits[first >> 3] |= 1 << (first & 7);
+}
+
+size_t stats_t::count(const uint8_t* bits, size_t cells)
+{
+  size_t n = 0;
+
+  for ( size_t i=0; bits && i < bitmap_bytes(cells); ++i )
+    n += __builtin_popcount(bits[i]);
+
+  return n;
+}
+
+uint64_t stats_t::instructions() const
+{
+  uint64_t sum = 0;
+
+  for ( size_t n=0; n <= NOP_END; ++n )
+    sum += ops[n];
+
+  return sum;
+}
+
+size_t stats_t::cells_read() const
+{
+  return count(read, memsize);
+}
+
+size_t stats_t::cells_written() const
+{
+  return count(written, memsize);
+}
+
+void stats_t::json(FILE* f) const
+{
+  const uint64_t total = instructions();
+
+  fprintf(f, "{\"instructions\":%" PRIu64 ",\"opcodes\":{", total);
+
+  for ( size_t n=0; n < NOP_END; ++n )
+    fprintf(f, "\"%s\":%" PRIu64 ",", OpStr[n], ops[n]);
+
+  fprintf(f, "\"unknown\":%" PRIu64 "},", ops[NOP_END]);
+  fprintf(f, "\"max_stack\":%lu,\"max_ip_stack\":%lu,",
+    static_cast<unsigned long>(max_stack),
+    static_cast<unsigned long>(max_stackip));
+  fprintf(f, "\"cells_read\":%lu,\"cells_written\":%lu,",
+    static_cast<unsigned long>(cells_read()),
+    static_cast<unsigned long>(cells_written()));
+  fprintf(f, "\"seconds\":%.6f,\"mips\":%.3f}\n", seconds,
+    seconds > 0 ? total/seconds/1e6 : 0.0);
+}
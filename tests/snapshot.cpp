@@ -0,0 +1,87 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ * Synopsis:  Exercise snapshots, clones, rollback and assignment of
+ *            machines, also between machines of different memory sizes.
+ *
+ */
+
+#include <stdio.h>
+#include "compiler.hpp"
+#include "error.hpp"
+
+// Prints a counter kept in memory, and counts it up
+static const char source[] =
+  "&main jmp\n"
+  "count: nop\n"
+  "main:\n"
+  "  &count load outnum '\\n' out\n"
+  "  &count load 1 add &count stor\n"
+  "  halt\n";
+
+static const size_t SMALL = 1024;
+static const size_t LARGE = 16*1024*1024;
+
+static snapshot_t* compile(size_t memory_words)
+{
+  parser p(source, sizeof(source) - 1);
+  compiler c(p, error, memory_words);
+  return new snapshot_t(c.get_program());
+}
+
+// Runs m, which prints its counter after the name of the step
+static void run(const char* step, machine_t& m)
+{
+  printf("%s: ", step);
+  fflush(stdout);
+  m.run();
+}
+
+int main()
+{
+  snapshot_t *small = compile(SMALL);
+  snapshot_t *large = compile(LARGE);
+
+  machine_t m(*small);
+  m.set_jit_threshold(1);
+  run("clone", m);
+  run("clone again", m);
+
+  snapshot_t later(m);
+  run("after snapshot", m);
+  m.rollback(*small);
+  run("rollback", m);
+  m.rollback(later);
+  run("rollback to later", m);
+
+  machine_t c(later);
+  run("second clone", c);
+  run("second clone again", c);
+  run("first clone", m);
+
+  machine_t d(m);
+  run("copy", d);
+  d = c;
+  run("assigned", d);
+
+  // the decode cache and native code of m are for the smaller memory
+  m.rollback(*large);
+  run("rollback to larger", m);
+  run("rollback to larger again", m);
+  m.rollback(*small);
+  run("rollback to smaller", m);
+
+  machine_t e(*large);
+  run("large clone", e);
+  e = m;
+  run("assigned smaller", e);
+  m = machine_t(*large);
+  run("assigned larger", m);
+
+  delete small;
+  delete large;
+  return 0;
+}
@@ -0,0 +1,324 @@
+/*
+ * Made in 2010 by Christian Stigen Larsen
+ * http://csl.sublevel3.org
+ *
+ * Placed in the public domain by the author.
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <limits>
+#include <type_traits>
+#include "vecops.hpp"
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(NO_SIMD)
+# define HAVE_SIMD
+# include <immintrin.h>
+#endif
+
+/*
+ * Scalar kernels, for any word type.  Words are added and multiplied as
+ * unsigned, where wrapping around is defined.
+ */
+
+template<typename word_t>
+static inline word_t s_add(word_t a, word_t b)
+{
+  typedef typename std::make_unsigned<word_t>::type uword_t;
+  return static_cast<word_t>(static_cast<uword_t>(a) +
+                             static_cast<uword_t>(b));
+}
+
+template<typename word_t>
+static inline word_t s_sub(word_t a, word_t b)
+{
+  typedef typename std::make_unsigned<word_t>::type uword_t;
+  return static_cast<word_t>(static_cast<uword_t>(a) -
+                             static_cast<uword_t>(b));
+}
+
+template<typename word_t>
+static inline word_t s_mul(word_t a, word_t b)
+{
+  typedef typename std::make_unsigned<word_t>::type uword_t;
+  return static_cast<word_t>(static_cast<uword_t>(a) *
+                             static_cast<uword_t>(b));
+}
+
+template<typename word_t>
+static inline word_t s_and(word_t a, word_t b) { return a & b; }
+
+template<typename word_t>
+static inline word_t s_or(word_t a, word_t b)  { return a | b; }
+
+template<typename word_t>
+static inline word_t s_xor(word_t a, word_t b) { return a ^ b; }
+
+template<typename word_t>
+static inline word_t s_min(word_t a, word_t b) { return a < b ? a : b; }
+
+template<typename word_t>
+static inline word_t s_max(word_t a, word_t b) { return a > b ? a : b; }
+
+#define SCALAR_BINARY(name, op) \
+  template<typename word_t> \
+  static void name(word_t* d, const word_t* a, const word_t* b, size_t n) \
+  { \
+    for ( size_t i=0; i < n; ++i ) \
+      d[i] = op(a[i], b[i]); \
+  }
+
+#define SCALAR_REDUCE(name, op, init) \
+  template<typename word_t> \
+  static word_t name(const word_t* a, size_t n) \
+  { \
+    word_t r = (init); \
+    for ( size_t i=0; i < n; ++i ) \
+      r = op(r, a[i]); \
+    return r; \
+  }
+
+SCALAR_BINARY(scalar_add, s_add)
+SCALAR_BINARY(scalar_sub, s_sub)
+SCALAR_BINARY(scalar_and, s_and)
+SCALAR_BINARY(scalar_or, s_or)
+SCALAR_BINARY(scalar_xor, s_xor)
+SCALAR_REDUCE(scalar_sum, s_add, 0)
+SCALAR_REDUCE(scalar_min, s_min, std::numeric_limits<word_t>::max())
+SCALAR_REDUCE(scalar_max, s_max, std::numeric_limits<word_t>::min())
+
+template<typename word_t>
+static word_t scalar_dot(const word_t* a, const word_t* b, size_t n)
+{
+  word_t r = 0;
+
+  for ( size_t i=0; i < n; ++i )
+    r = s_add(r, s_mul(a[i], b[i]));
+
+  return r;
+}
+
+static const vecops_t scalar = {
+  "scalar",
+  {scalar_add<int32_t>, scalar_sub<int32_t>, scalar_and<int32_t>,
+   scalar_or<int32_t>, scalar_xor<int32_t>},
+  {scalar_sum<int32_t>, scalar_min<int32_t>, scalar_max<int32_t>},
+  scalar_dot<int32_t>
+};
+
+static const basic_vecops_t<int64_t> scalar64 = {
+  "scalar",
+  {scalar_add<int64_t>, scalar_sub<int64_t>, scalar_and<int64_t>,
+   scalar_or<int64_t>, scalar_xor<int64_t>},
+  {scalar_sum<int64_t>, scalar_min<int64_t>, scalar_max<int64_t>},
+  scalar_dot<int64_t>
+};
+
+#ifdef HAVE_SIMD
+
+/*
+ * SIMD kernels.  Each runs over whole vectors of cells, and finishes the
+ * rest with the scalar code.  SSE2 lacks 32-bit multiplication, minimum
+ * and maximum, which are built from what it has.
+ */
+
+#define SSE2_BINARY(name, vop, op) \
+  static void name(int32_t* d, const int32_t* a, const int32_t* b, size_t n) \
+  { \
+    size_t i = 0; \
+    for ( ; i + 4 <= n; i += 4 ) { \
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)); \
+      __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)); \
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(d + i), vop(x, y)); \
+    } \
+    for ( ; i < n; ++i ) \
+      d[i] = op(a[i], b[i]); \
+  }
+
+SSE2_BINARY(sse2_add, _mm_add_epi32, s_add)
+SSE2_BINARY(sse2_sub, _mm_sub_epi32, s_sub)
+SSE2_BINARY(sse2_and, _mm_and_si128, s_and)
+SSE2_BINARY(sse2_or, _mm_or_si128, s_or)
+SSE2_BINARY(sse2_xor, _mm_xor_si128, s_xor)
+
+static inline __m128i sse2_min_epi32(__m128i x, __m128i y)
+{
+  __m128i gt = _mm_cmpgt_epi32(x, y);
+  return _mm_or_si128(_mm_and_si128(gt, y), _mm_andnot_si128(gt, x));
+}
+
+static inline __m128i sse2_max_epi32(__m128i x, __m128i y)
+{
+  __m128i gt = _mm_cmpgt_epi32(x, y);
+  return _mm_or_si128(_mm_and_si128(gt, x), _mm_andnot_si128(gt, y));
+}
+
+// the low 32 bits of each product, which are the same signed or not
+static inline __m128i sse2_mullo_epi32(__m128i x, __m128i y)
+{
+  __m128i even = _mm_mul_epu32(x, y);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(x, 32), _mm_srli_epi64(y, 32));
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+#define SSE2_REDUCE(name, vop, op, init) \
+  static int32_t name(const int32_t* a, size_t n) \
+  { \
+    __m128i r = _mm_set1_epi32(init); \
+    size_t i = 0; \
+    for ( ; i + 4 <= n; i += 4 ) \
+      r = vop(r, _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i))); \
+    int32_t lanes[4]; \
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), r); \
+    int32_t s = op(op(lanes[0], lanes[1]), op(lanes[2], lanes[3])); \
+    for ( ; i < n; ++i ) \
+      s = op(s, a[i]); \
+    return s; \
+  }
+
+SSE2_REDUCE(sse2_sum, _mm_add_epi32, s_add, 0)
+SSE2_REDUCE(sse2_min, sse2_min_epi32, s_min, INT32_MAX)
+SSE2_REDUCE(sse2_max, sse2_max_epi32, s_max, INT32_MIN)
+
+static int32_t sse2_dot(const int32_t* a, const int32_t* b, size_t n)
+{
+  __m128i r = _mm_setzero_si128();
+  size_t i = 0;
+
+  for ( ; i + 4 <= n; i += 4 ) {
+    __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+    __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+    r = _mm_add_epi32(r, sse2_mullo_epi32(x, y));
+  }
+
+  int32_t lanes[4];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), r);
+  int32_t s = s_add(s_add(lanes[0], lanes[1]), s_add(lanes[2], lanes[3]));
+
+  for ( ; i < n; ++i )
+    s = s_add(s, s_mul(a[i], b[i]));
+
+  return s;
+}
+
+static const vecops_t sse2 = {
+  "sse2",
+  {sse2_add, sse2_sub, sse2_and, sse2_or, sse2_xor},
+  {sse2_sum, sse2_min, sse2_max},
+  sse2_dot
+};
+
+#define AVX2 __attribute__((target("avx2")))
+
+#define AVX2_BINARY(name, vop, op) \
+  AVX2 static void name(int32_t* d, const int32_t* a, const int32_t* b, \
+                        size_t n) \
+  { \
+    size_t i = 0; \
+    for ( ; i + 8 <= n; i += 8 ) { \
+      __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i)); \
+      __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)); \
+      _mm256_storeu_si256(reinterpret_cast<__m256i*>(d + i), vop(x, y)); \
+    } \
+    for ( ; i < n; ++i ) \
+      d[i] = op(a[i], b[i]); \
+  }
+
+AVX2_BINARY(avx2_add, _mm256_add_epi32, s_add)
+AVX2_BINARY(avx2_sub, _mm256_sub_epi32, s_sub)
+AVX2_BINARY(avx2_and, _mm256_and_si256, s_and)
+AVX2_BINARY(avx2_or, _mm256_or_si256, s_or)
+AVX2_BINARY(avx2_xor, _mm256_xor_si256, s_xor)
+
+#define AVX2_REDUCE(name, vop, op, init) \
+  AVX2 static int32_t name(const int32_t* a, size_t n) \
+  { \
+    __m256i r = _mm256_set1_epi32(init); \
+    size_t i = 0; \
+    for ( ; i + 8 <= n; i += 8 ) \
+      r = vop(r, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i))); \
+    int32_t lanes[8]; \
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), r); \
+    int32_t s = (init); \
+    for ( int l=0; l < 8; ++l ) \
+      s = op(s, lanes[l]); \
+    for ( ; i < n; ++i ) \
+      s = op(s, a[i]); \
+    return s; \
+  }
+
+AVX2_REDUCE(avx2_sum, _mm256_add_epi32, s_add, 0)
+AVX2_REDUCE(avx2_min, _mm256_min_epi32, s_min, INT32_MAX)
+AVX2_REDUCE(avx2_max, _mm256_max_epi32, s_max, INT32_MIN)
+
+AVX2 static int32_t avx2_dot(const int32_t* a, const int32_t* b, size_t n)
+{
+  __m256i r = _mm256_setzero_si256();
+  size_t i = 0;
+
+  for ( ; i + 8 <= n; i += 8 ) {
+    __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+    r = _mm256_add_epi32(r, _mm256_mullo_epi32(x, y));
+  }
+
+  int32_t lanes[8];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), r);
+  int32_t s = 0;
+
+  for ( int l=0; l < 8; ++l )
+    s = s_add(s, lanes[l]);
+
+  for ( ; i < n; ++i )
+    s = s_add(s, s_mul(a[i], b[i]));
+
+  return s;
+}
+
+static const vecops_t avx2 = {
+  "avx2",
+  {avx2_add, avx2_sub, avx2_and, avx2_or, avx2_xor},
+  {avx2_sum, avx2_min, avx2_max},
+  avx2_dot
+};
+
+#endif
+
+static const vecops_t* pick()
+{
+  const char *want = getenv("SM_VECOPS");
+
+  if ( want && !strcmp(want, "scalar") )
+    return &scalar;
+
+#ifdef HAVE_SIMD
+  __builtin_cpu_init();
+
+  if ( want && !strcmp(want, "sse2") )
+    return &sse2;
+
+  if ( __builtin_cpu_supports("avx2") )
+    return &avx2;
+
+  // every x86-64 has SSE2
+  return &sse2;
+#else
+  return &scalar;
+#endif
+}
+
+template<>
+const vecops_t& vecops<int32_t>()
+{
+  static const vecops_t *ops = pick();
+  return *ops;
+}
+
+template<>
+const basic_vecops_t<int64_t>& vecops<int64_t>()
+{
+  return scalar64;
+}